@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "fat12.hpp"
+#include "fat12_dir_scan.hpp"
+
+/*
+    Benchmark harness for fat12_fs.
+    Every case formats a fresh image in a scratch directory, prepares it
+    (fill level, directory fan-out, source files) and then times one
+    operation per sample. Results are printed as one line per case with
+    latency percentiles in microseconds:
+
+        case  p50  p90  p99  max  samples
+
+    --output FILE saves that table, --baseline FILE compares p50 against a
+    previously saved table.
+*/
+
+using fat12::fat12_fs;
+using std::string;
+
+namespace {
+
+    typedef std::chrono::steady_clock Clock;
+
+    struct Result {
+        string name;
+        double p50, p90, p99, max;
+        size_t samples;
+    };
+
+    string scratch_dir;
+    std::vector<Result> results;
+
+    double percentile(std::vector<double>& sorted, double p) {
+        if (sorted.empty())
+            return 0;
+        size_t idx = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+        return sorted[idx];
+    }
+
+    void record(const string& name, std::vector<double> samples) {
+        std::sort(samples.begin(), samples.end());
+        Result r = { name, percentile(samples, 0.50), percentile(samples, 0.90),
+                     percentile(samples, 0.99), samples.empty() ? 0 : samples.back(), samples.size() };
+        results.push_back(r);
+        std::cout << std::left << std::setw(44) << r.name << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(10) << r.p50 << std::setw(10) << r.p90 << std::setw(10) << r.p99
+                  << std::setw(10) << r.max << std::setw(8) << r.samples << std::endl;
+    }
+
+    // Time fn once, returns microseconds
+    template <typename Fn>
+    double timed(Fn fn) {
+        Clock::time_point start = Clock::now();
+        fn();
+        return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+    }
+
+    string source_file(size_t size) {
+        string path = scratch_dir + "/src" + std::to_string(size);
+        std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+        string chunk(4096, '\0');
+        for (size_t i = 0; i < chunk.size(); ++i)
+            chunk[i] = static_cast<char>(i * 31 + 7);
+        for (size_t left = size; left > 0; ) {
+            size_t n = std::min(left, chunk.size());
+            ofs.write(chunk.data(), n);
+            left -= n;
+        }
+        return path;
+    }
+
+    string label(double block_kb) {
+        return block_kb < 1 ? "bs=512" : "bs=1024";
+    }
+
+    // A mounted image, filled to fill_pct percent with 16 KB files under /fill
+    struct Image {
+        string path;
+        std::ostringstream sink;
+        fat12_fs* fs;
+
+        Image(double block_kb, int fill_pct) : path(scratch_dir + "/image"), fs(nullptr) {
+            {
+                fat12_fs creator(path);
+                creator.set_output(&sink);
+                creator.create_fs(block_kb);
+            }
+            fs = new fat12_fs(path, true);
+            fs->set_output(&sink);
+            fs->read_fs();
+
+            if (fill_pct > 0) {
+                size_t image_bytes = static_cast<size_t>(block_kb * 1024) * 4096;
+                size_t fill_file = 16 * 1024;
+                string src = source_file(fill_file);
+                fs->dispatch("mkdir", "/fill");
+                size_t cnt = image_bytes * fill_pct / 100 / fill_file;
+                for (size_t i = 0; i < cnt; ++i)
+                    fs->dispatch("write", "/fill/f" + std::to_string(i) + " " + src);
+                fs->dump_fs();
+            }
+        }
+
+        ~Image() {
+            delete fs;
+            std::remove(path.c_str());
+        }
+
+        void op(const string& operation, const string& param) {
+            fs->dispatch(operation, param);
+            sink.str("");
+        }
+    };
+
+    void bench_mount(double block_kb, int fill_pct) {
+        Image image(block_kb, fill_pct);
+        string suffix = "/" + label(block_kb) + "/fill=" + std::to_string(fill_pct);
+
+        std::vector<double> reads, dumps;
+        for (int i = 0; i < 200; ++i)
+            reads.push_back(timed([&]() { image.fs->read_fs(); }));
+        record("read_fs" + suffix, reads);
+
+        for (int i = 0; i < 200; ++i) {
+            image.op("mkdir", "/m" + std::to_string(i));
+            dumps.push_back(timed([&]() { image.fs->dump_fs(); }));
+        }
+        record("dump_fs" + suffix, dumps);
+    }
+
+    void bench_directory(double block_kb, int fanout) {
+        Image image(block_kb, 0);
+        string suffix = "/" + label(block_kb) + "/fanout=" + std::to_string(fanout);
+
+        image.op("mkdir", "/fan");
+        for (int i = 0; i < fanout; ++i)
+            image.op("mkdir", "/fan/e" + std::to_string(i));
+
+        std::vector<double> dirs, mkdirs;
+        for (int i = 0; i < 100; ++i)
+            dirs.push_back(timed([&]() { image.op("dir", "/fan"); }));
+        record("dir" + suffix, dirs);
+
+        for (int i = 0; i < 100; ++i)
+            mkdirs.push_back(timed([&]() { image.op("mkdir", "/fan/n" + std::to_string(i)); }));
+        record("mkdir" + suffix, mkdirs);
+    }
+
+    // Name lookup of the last entry of a wide directory on a freshly read
+    // image, as a one-shot command sees it, with and without the index
+    void bench_lookup(double block_kb, int fanout, bool index) {
+        Image image(block_kb, 0);
+        string suffix = "/" + label(block_kb) + "/fanout=" + std::to_string(fanout)
+                      + "/index=" + (index ? "on" : "off");
+
+        image.op("mkdir", "/fan");
+        for (int i = 0; i < fanout; ++i)
+            image.op("mkdir", "/fan/e" + std::to_string(i));
+        image.fs->dump_fs();
+        image.fs->set_dir_index(index);
+
+        string last = "/fan/e" + std::to_string(fanout - 1);
+        std::vector<double> lookups;
+        for (int i = 0; i < 100; ++i) {
+            image.fs->read_fs();
+            lookups.push_back(timed([&]() { image.op("dir", last); }));
+        }
+        record("lookup" + suffix, lookups);
+    }
+
+    // The dispatched slot scanners (AVX2 where available) must agree with
+    // the scalar kernels on random directory blocks
+    void check_dir_scan() {
+        using fat12::DirectoryEntry;
+        std::srand(12);
+        std::vector<DirectoryEntry> slots(256);
+        char key[11];
+        for (int round = 0; round < 2000; ++round) {
+            int cnt = std::rand() % static_cast<int>(slots.size() + 1);
+            std::memset(slots.data(), 0, slots.size() * sizeof(DirectoryEntry));
+            for (int i = 0; i < cnt; ++i) {
+                int kind = std::rand() % 16;
+                if (kind == 0)
+                    continue; // never used
+                fat12::make_name_key("n" + std::to_string(std::rand() % 64), key);
+                std::memcpy(&slots[i], key, sizeof(key)); // filename and extension
+                if (kind == 1)
+                    slots[i].filename[0] = fat12::DIR_NAME_FREE[0];
+            }
+            fat12::make_name_key("n" + std::to_string(std::rand() % 64), key);
+
+            if (fat12::find_free_slot(slots.data(), cnt) != fat12::find_free_slot_scalar(slots.data(), cnt)
+                || fat12::find_name_slot(slots.data(), cnt, key) != fat12::find_name_slot_scalar(slots.data(), cnt, key)) {
+                throw std::runtime_error(string("Slot scanner ") + fat12::dir_scan_kernel_name()
+                                         + " disagrees with scalar on " + std::to_string(cnt) + " slots");
+            }
+        }
+        std::cout << "dir scan kernel " << fat12::dir_scan_kernel_name() << " agrees with scalar" << std::endl;
+    }
+
+    void bench_file(double block_kb, int fill_pct, size_t size) {
+        Image image(block_kb, fill_pct);
+        string suffix = "/" + label(block_kb) + "/fill=" + std::to_string(fill_pct)
+                      + "/size=" + std::to_string(size);
+        string src = source_file(size);
+        string dst = scratch_dir + "/dst";
+
+        std::vector<double> writes, reads;
+        for (int i = 0; i < 50; ++i) {
+            writes.push_back(timed([&]() { image.op("write", "/w " + src); }));
+            image.op("del", "/w");
+        }
+        record("write" + suffix, writes);
+
+        image.op("write", "/r " + src);
+        for (int i = 0; i < 50; ++i)
+            reads.push_back(timed([&]() { image.op("read", "/r " + dst); }));
+        record("read" + suffix, reads);
+        std::remove(dst.c_str());
+    }
+
+    void save(const string& path) {
+        std::ofstream ofs(path);
+        ofs << std::fixed << std::setprecision(1);
+        for (auto& r : results)
+            ofs << r.name << ' ' << r.p50 << ' ' << r.p90 << ' ' << r.p99 << ' ' << r.max << ' ' << r.samples << '\n';
+    }
+
+    void compare(const string& path) {
+        std::ifstream ifs(path);
+        if (!ifs.is_open()) {
+            std::cerr << "Cannot open baseline: " << path << std::endl;
+            return;
+        }
+        std::map<string, double> base;
+        string name;
+        double p50, rest;
+        string line;
+        while (std::getline(ifs, line)) {
+            std::istringstream fields(line);
+            if (fields >> name >> p50 >> rest)
+                base[name] = p50;
+        }
+
+        std::cout << "\np50 against " << path << ":\n";
+        for (auto& r : results) {
+            auto it = base.find(r.name);
+            if (it == base.end() || it->second <= 0)
+                continue;
+            double delta = (r.p50 - it->second) * 100 / it->second;
+            std::cout << std::left << std::setw(44) << r.name << std::right << std::fixed << std::setprecision(1)
+                      << std::setw(10) << it->second << " -> " << std::setw(10) << r.p50
+                      << std::showpos << std::setw(8) << delta << "%" << std::noshowpos << std::endl;
+        }
+    }
+
+}//namespace
+
+int main(int argc, char* argv[]) {
+    string output, baseline;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--output" && i + 1 < argc) {
+            output = argv[++i];
+        }
+        else if (arg == "--baseline" && i + 1 < argc) {
+            baseline = argv[++i];
+        }
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--output FILE] [--baseline FILE]" << std::endl;
+            return 1;
+        }
+    }
+
+    char tmpl[] = "/tmp/fat12_bench.XXXXXX";
+    if (mkdtemp(tmpl) == nullptr) {
+        std::perror("mkdtemp");
+        return 1;
+    }
+    scratch_dir = tmpl;
+
+    std::cout << std::left << std::setw(44) << "case (us)" << std::right << std::setw(10) << "p50"
+              << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "max"
+              << std::setw(8) << "n" << std::endl;
+
+    int status = 0;
+    try {
+        check_dir_scan();
+        const double block_sizes[] = { 0.5, 1 };
+        for (double bs : block_sizes) {
+            for (int fill : { 0, 50, 90 })
+                bench_mount(bs, fill);
+            for (int fanout : { 8, 64, 200 })
+                bench_directory(bs, fanout);
+            for (bool index : { true, false })
+                bench_lookup(bs, 200, index);
+            for (int fill : { 0, 90 }) {
+                for (size_t size : { static_cast<size_t>(512), static_cast<size_t>(8 * 1024), static_cast<size_t>(128 * 1024) })
+                    bench_file(bs, fill, size);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Benchmark failed: " << e.what() << std::endl;
+        status = 1;
+    }
+
+    for (size_t size : { 512, 8 * 1024, 16 * 1024, 128 * 1024 })
+        std::remove((scratch_dir + "/src" + std::to_string(size)).c_str());
+    rmdir(scratch_dir.c_str());
+
+    if (status == 0 && !output.empty())
+        save(output);
+    if (status == 0 && !baseline.empty())
+        compare(baseline);
+    return status;
+}
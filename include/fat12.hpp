@@ -1,14 +1,29 @@
 #ifndef FAT12_FS_HPP
 #define FAT12_FS_HPP
 
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <cstring>
 #include <vector>
 #include <sstream>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
 
+#include "fat12_allocator.hpp"
 #include "fat12_data_types.hpp"
+#include "fat12_dentry_cache.hpp"
+#include "fat12_dir_index.hpp"
+#include "fat12_dir_iterator.hpp"
+#include "fat12_dir_scan.hpp"
+#include "fat12_dirty_ranges.hpp"
+#include "fat12_extent_map.hpp"
+#include "fat12_fat_codec.hpp"
+#include "fat12_rwlock.hpp"
+#include "fat12_stats.hpp"
 #include "fat12_utils.hpp"
 
 using std::string;
@@ -16,16 +31,71 @@ using fat12::BootSector;
 
 namespace fat12 {
 
+    // Physically consecutive clusters of a chain
+    struct ClusterRun {
+        uint16_t start;
+        uint16_t count;
+    };
+
+    // open() mode bits
+    const int OPEN_READ = 0x1;
+    const int OPEN_WRITE = 0x2;
+    const int OPEN_CREATE = 0x4; // create the file when missing, needs OPEN_WRITE
+    const int OPEN_TRUNC = 0x8;  // drop the contents, needs OPEN_WRITE
+
+    // What stat() reports about an open file
+    struct FileStat {
+        uint32_t size;
+        uint32_t clusters;
+        uint32_t extents;
+        uint8_t attributes;
+        std::time_t created;
+        std::time_t modified;
+    };
+
+    /*
+        Concurrency model. One mounted image may be shared by any number of
+        threads through dispatch() (and operate()/run_batch() on top of it),
+        the file handle API, dump_fs(), read_fs() and create_fs(). Each call
+        holds fs_lock for its whole duration, in one of four modes:
+
+        - read: dir, read, stats, and read_at()/stat() on a handle. Shared.
+        - scan: dumpe2fs, export and defrag report, which walk the whole
+          tree and FAT. Shared, plus scan_lock exclusively.
+        - create: mkdir and write, which add or replace entries. Shared,
+          plus scan_lock shared: creators run in parallel with each other
+          and with reads, not with scans.
+        - exclusive: every other command, open(), write_at(), truncate(),
+          close(), dump_fs(), read_fs(), create_fs() and set_dir_index().
+
+        In the shared modes a directory's slots, and the entries and chains
+        of its files, are guarded by the directory's stripe of dir_locks:
+        readers take it shared while they use the directory, creators take
+        it exclusive along with the stripe of the directory that holds the
+        parent's own entry, whose time they update. A thread holds at most
+        those two stripes, taken in order. Clusters come from the
+        allocation groups of ClusterAllocator, which lock themselves; shadow
+        FAT entries of different clusters are separate objects and the
+        dirty range sets sit behind dirty_lock. The dentry cache locks
+        itself, directory indexes and extent maps are looked up and
+        inserted under cache_lock, and stats are atomic.
+        Command output goes to the stream given to dispatch(), or to the
+        one set with set_output(), which must not change while other
+        threads use the image. Commands called directly (mkdir(), dir()...)
+        don't take fs_lock and are for single threaded use only.
+    */
     class fat12_fs {
     private:
         string name;
         uint16_t block_size_byte;
-        uint16_t number_of_blocks;
-        int total_size_bytes;
+        uint32_t number_of_blocks;
+        size_t total_size_bytes;
         int total_size_kb;
         int fat_size_bytes;
+        int fat_bits; // 12 or 16, from the data cluster count at mount
 
         int entry_cnt_in_block;
+        int cluster_cnt; // number of FAT entries backed by data area clusters
         
         
         // Start addresses
@@ -34,39 +104,195 @@ namespace fat12 {
         int root_dir_start;
         int data_area_start;
 
+        // Image backing: either a heap copy of the image or a MAP_SHARED mapping
+        bool mmap_mode;
+        int image_fd;
+        size_t mapped_size; // non-zero while fs_buffer points into a mapping
+
         // pointers to clusters
         char* fs_buffer;
         BootSector* boot_sector;
         DirectoryEntry* root;
-        FatEntry* FAT;
+        std::vector<FatEntry> FAT; // decoded shadow of the on-disk FAT
         uint8_t* data_area;
+        DirectoryEntry root_dir; // handle for the root directory, starting_cluster 0
+
+        // see the class comment
+        RwLock fs_lock;
+        RwLock scan_lock;
+        StripedRwLock dir_locks; // keyed by directory cluster (0 = root)
+        // guards dir_indexes and extent_maps lookups and inserts
+        std::mutex cache_lock;
+        // guards dirty and fat_dirty
+        std::mutex dirty_lock;
+
+        // path resolution cache
+        DentryCache dentries;
+
+        // per-directory name indexes keyed by directory cluster (0 = root)
+        bool dir_index_enabled;
+        std::unordered_map<uint16_t, DirIndex> dir_indexes;
+
+        // open file handles, the entry is kept as an offset into the image
+        struct OpenFile {
+            size_t entry_offset;
+            uint16_t dir; // cluster of the directory holding the entry
+            int mode;
+        };
+        std::unordered_map<int, OpenFile> open_files;
+        int next_handle;
+
+        // extent maps of the files read or written this mount, keyed by
+        // starting cluster; free_chain() drops a file's map
+        std::unordered_map<uint16_t, ExtentMap> extent_maps;
+
+        // free cluster index, kept in sync by set_fat()
+        ClusterAllocator allocator;
+
+        // command output (listings, reports), kept apart from diagnostics;
+        // call_out overrides it for the dispatch() running on this thread
+        std::ostream* out;
+        static thread_local std::ostream* call_out;
+        std::ostream& output() { return call_out != nullptr ? *call_out : *out; }
+
+        // operation counters and command latencies, see show_stats()
+        Stats stats;
+
+        // regions modified since the last dump_fs()
+        DirtyRanges dirty;
+        // shadow FAT entry ranges not yet encoded into the packed tables
+        DirtyRanges fat_dirty;
 
         // Main file system operations
-        void format(char* buffer);
+        void format(std::vector<char>& buffer);
+        void map_fs();
+        void load_fs_buffer();
+        void parse_fs();
+        void release_fs_buffer();
         void traverse(DirectoryEntry* entry);
+        void walk_tree(DirectoryEntry* dir, const string& path,
+                       const std::function<void(DirectoryEntry&, const string&)>& visit,
+                       const std::function<void(const string&, const std::runtime_error&)>& unreadable = nullptr);
 
         // Directory operations
         void create_dir(DirectoryEntry* empty, DirectoryEntry* parent, string& dir_name);
         DirectoryEntry* find_dir(DirectoryEntry* current, string& dir_name);
         DirectoryEntry* find_dir_recursive(std::vector<std::string> tokens);
         DirectoryEntry* find_empty_dir(DirectoryEntry* current);
+        DirectoryEntry* find_entry(DirectoryEntry* dir, const string& name);
+        bool is_root_dir(const DirectoryEntry* dir);
+        uint16_t dir_cluster(const DirectoryEntry* dir);
+        uint16_t parent_cluster(const DirectoryEntry* dir);
+        DirectoryEntry* extend_dir(DirectoryEntry* dir);
+        DirIndex* get_dir_index(DirectoryEntry* dir);
+        DirIndex* cached_dir_index(uint16_t cluster);
+        void claim_slot(DirectoryEntry* parent, DirectoryEntry* slot, const string& name);
+        void release_slot(DirectoryEntry* parent, DirectoryEntry* slot, const string& name);
         void initialize_new_dir(uint16_t cluster_num, DirectoryEntry* current, DirectoryEntry* parent);
 
         // File opeations
         void create_file(DirectoryEntry* empty, DirectoryEntry* parent, string file_name);
-        void write_file(DirectoryEntry* file, string& content);
+        void write_file(DirectoryEntry* file, int src_fd, uint32_t size);
+        void read_file(DirectoryEntry* file, int dst_fd);
 
         // utilities
+        void build_allocator();
         uint16_t reserve_cluster();
+        int reserve_contiguous(int cnt);
+        uint16_t reserve_chain(int cnt);
+        void free_chain(uint16_t start);
+        std::vector<ClusterRun> get_chain_runs(uint16_t start);
+        ExtentMap& file_extents(uint16_t start);
+        uint8_t* cluster_ptr(uint16_t cluster);
+
+        // file handle helpers
+        OpenFile& open_file(int handle);
+        DirectoryEntry* handle_entry(const OpenFile& file);
+        bool is_open(const DirectoryEntry* entry);
+        void resize_chain(DirectoryEntry* file, uint32_t cnt);
+        void resize_file(DirectoryEntry* file, uint32_t size);
+        void transfer(ExtentMap& map, uint32_t offset, size_t len, const char* src, char* dst);
+
+        // Visit the slots of a directory, either the fixed root region or
+        // a cluster chain, until pred returns true. Returns that slot.
+        template <typename Pred>
+        DirectoryEntry* scan_dir(DirectoryEntry* dir, Pred pred) {
+            if (is_root_dir(dir)) {
+                for (int i = 0; i < boot_sector->BPB_RootEntCnt; ++i) {
+                    if (pred(root[i])) {
+                        stats.add(STAT_DIR_ENTRIES_SCANNED, i + 1);
+                        return &root[i];
+                    }
+                }
+                stats.add(STAT_DIR_ENTRIES_SCANNED, boot_sector->BPB_RootEntCnt);
+                return nullptr;
+            }
+
+            uint64_t scanned = 0;
+            for (auto& run : get_chain_runs(dir->starting_cluster)) {
+                auto slots = reinterpret_cast<DirectoryEntry*>(cluster_ptr(run.start));
+                int cnt = run.count * entry_cnt_in_block;
+                for (int i = 0; i < cnt; ++i) {
+                    if (pred(slots[i])) {
+                        stats.add(STAT_DIR_ENTRIES_SCANNED, scanned + i + 1);
+                        return &slots[i];
+                    }
+                }
+                scanned += cnt;
+            }
+            stats.add(STAT_DIR_ENTRIES_SCANNED, scanned);
+            return nullptr;
+        }
+        // Hand each block of contiguous slots of a directory to
+        // find(slots, cnt), which returns the index of a match or -1.
+        // Used with the vectorized scanners of fat12_dir_scan.hpp.
+        template <typename Find>
+        DirectoryEntry* scan_slots(DirectoryEntry* dir, Find find) {
+            if (is_root_dir(dir)) {
+                int i = find(root, static_cast<int>(boot_sector->BPB_RootEntCnt));
+                stats.add(STAT_DIR_ENTRIES_SCANNED, i < 0 ? boot_sector->BPB_RootEntCnt : i + 1);
+                return i < 0 ? nullptr : &root[i];
+            }
+
+            for (auto& run : get_chain_runs(dir->starting_cluster)) {
+                auto slots = reinterpret_cast<DirectoryEntry*>(cluster_ptr(run.start));
+                int cnt = run.count * entry_cnt_in_block;
+                int i = find(slots, cnt);
+                stats.add(STAT_DIR_ENTRIES_SCANNED, i < 0 ? cnt : i + 1);
+                if (i >= 0)
+                    return &slots[i];
+            }
+            return nullptr;
+        }
+        void set_fat(uint16_t idx, FatEntry value);
+        struct Command {
+            const char* name;
+            void (*run)(fat12_fs& fs, const string& param);
+        };
+        static const Command* find_command(const string& operation);
+        void run_command(const string& operation, const string& param);
+        // how a command holds fs_lock, see the class comment
+        enum LockMode { MODE_READ, MODE_SCAN, MODE_CREATE, MODE_EXCLUSIVE };
+        static LockMode lock_mode(const string& operation, const string& param);
+        void show_stats(const string& param);
+        void flush_fat();
+        void mark_dirty(const void* ptr, size_t len);
+        size_t buffer_offset(const void* ptr);
         int get_entry_cnt(DirectoryEntry* dir);
         bool is_in_root(DirectoryEntry* dir);
         
     public:
     
-        fat12_fs(string name):name(name){};
+        fat12_fs(string name, bool mmap_mode = false)
+            : name(name), fat_bits(12), mmap_mode(mmap_mode), image_fd(-1), mapped_size(0), fs_buffer(nullptr),
+              dir_index_enabled(true), next_handle(1), out(&std::cout) {
+            // FAT12_STATS=1 enables counters from the start, otherwise "stats on"
+            const char* env = std::getenv("FAT12_STATS");
+            stats.set_enabled(env != nullptr && env[0] == '1');
+        };
         ~fat12_fs(){ 
             //dump_fs(); 
-            delete[] fs_buffer;
+            release_fs_buffer();
         };
 
         // commands
@@ -76,78 +302,44 @@ namespace fat12 {
         void write(const string& path);
         void read(const string& path);
         void chmod(const string& path);
+        void del(const string& path);
         //void addpw(const string& path);
-        void dumpe2fs();
+        void dumpe2fs(const string& param = "");
+        int fsck(const string& param);
+        void import(const string& param);
+        void export_tree(const string& param); // "export" is a keyword
+        void defrag(const string& param);
+
+        // file handles: binary-safe access to byte ranges of a file.
+        // Changes reach the image file on dump_fs() like any command.
+        int open(const string& path, int mode);
+        size_t read_at(int handle, uint32_t offset, void* buf, size_t len);
+        size_t write_at(int handle, uint32_t offset, const void* buf, size_t len);
+        void truncate(int handle, uint32_t size);
+        FileStat stat(int handle);
+        void close(int handle);
 
         // utils
         void print_cluster(uint16_t cluster);
         void traverse_all();
         void dump_fs();
-        void create_fs(int size_kb);
+        void create_fs(double size_kb, uint32_t block_cnt = DEFAULT_BLOCK_CNT);
         void read_fs();
-        void operate(const string& operation, const string& param);
-
-
-        friend class Fat12Iterator;
-        class Fat12Iterator {
-        private:
-            fat12_fs* fs;
-            DirectoryEntry* root_entry;
-            DirectoryEntry* current_cluster;
-            uint16_t current_cluster_num;
-            int current_idx;
-            int current_char_idx;
-            int fat_idx;
-
-            void load_cluster(uint16_t cluster) {
-                auto cluster_start = cluster * fs->block_size_byte;
-                current_cluster = reinterpret_cast<DirectoryEntry*>(&(fs->data_area[cluster_start]));
-            }
-
-            void advance_cluster() {
-                current_cluster_num = fs->FAT[fat_idx];
-                current_idx = 0;
-                load_cluster(current_cluster_num);
-            }
+        bool operate(const string& operation, const string& param);
+        void dispatch(const string& operation, const string& param);
+        // as above with the command output going to os, for this call only
+        void dispatch(const string& operation, const string& param, std::ostream& os);
+        // whether a command can run under the shared lock
+        static bool is_read_only(const string& operation, const string& param);
+        int run_batch(std::istream& script);
+        void set_dir_index(bool enabled);
+        void set_output(std::ostream* os) { out = os; }
+        Stats& get_stats() { return stats; }
+        const string& get_name() const { return name; }
 
-        public:
-            Fat12Iterator(DirectoryEntry* entry, fat12_fs* fs) 
-                : root_entry(entry), fs(fs), current_cluster_num(entry->starting_cluster), current_idx(0) {
-                if (fat12::is_directory(*root_entry)) {
-                    this->fat_idx = entry->starting_cluster;
-                    fat12::check_fat_idx(fat_idx);
-                    load_cluster(current_cluster_num);
-                }
-            }
 
-            Fat12Iterator(uint16_t cluster_num, fat12_fs* fs) 
-                : fs(fs), current_cluster_num(cluster_num) , current_idx(0) {
-                    this->fat_idx = current_cluster_num;
-                    fat12::check_fat_idx(fat_idx);
-                    load_cluster(current_cluster_num);
-            }
-
-            bool has_next() {
-                return (current_idx < (fs->entry_cnt_in_block - 1))
-                            || !is_last_cluster(fs->FAT[fat_idx]);
-            }
-
-            DirectoryEntry* next() {
-                if (current_idx >= fs->entry_cnt_in_block) {
-                    advance_cluster();
-                }
-
-                return &current_cluster[current_idx++];
-            }
-        };
-
-        Fat12Iterator* iterator(DirectoryEntry* entry){
-            return new Fat12Iterator(entry, this);
-        }
-
-        Fat12Iterator* iterator(uint16_t cluster_num){
-            return new Fat12Iterator(cluster_num, this);
-        }
+        // Live entries of a directory, for (auto& entry : entries(dir))
+        DirRange entries(DirectoryEntry* dir);
     };
 
 }//namespace
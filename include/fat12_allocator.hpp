@@ -0,0 +1,73 @@
+#ifndef FAT12_ALLOCATOR_HPP
+#define FAT12_ALLOCATOR_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace fat12 {
+
+    /*
+        Free cluster index built from the FAT at mount time.
+        One bit per cluster (set = in use), split into allocation groups of
+        GROUP_CLUSTERS clusters. Every group has its own lock, free count
+        and next-fit cursor, so an allocation resumes where the previous
+        one in that group stopped instead of rescanning the FAT, and
+        threads allocating at the same time work in different groups:
+        each thread starts from its own group and moves on when it fills.
+        Runs that don't fit in one group are searched with every group
+        locked, in order.
+        The owner must report every FAT change through mark_used/mark_free.
+    */
+    class ClusterAllocator {
+    public:
+        // a multiple of 64, so groups never share a bitmap word
+        static const uint32_t GROUP_CLUSTERS = 512;
+
+    private:
+        struct Group {
+            std::mutex lock;
+            uint32_t start;   // first cluster of the group
+            uint32_t end;     // one past the last cluster of the group
+            uint32_t cursor;  // next-fit start position
+            uint32_t free_cnt;
+        };
+
+        std::vector<uint64_t> bits;
+        std::unique_ptr<Group[]> groups;
+        uint32_t group_cnt;
+        uint32_t first;   // first allocatable cluster
+        uint32_t limit;   // one past the last allocatable cluster
+        std::atomic<uint32_t> free_cnt;
+
+        Group& group_of(uint32_t cluster) { return groups[cluster / GROUP_CLUSTERS]; }
+        uint32_t home_group() const;
+        uint32_t find_free(uint32_t from, uint32_t to) const;
+        uint32_t run_length(uint32_t from, uint32_t to, uint32_t max) const;
+        uint32_t find_run(uint32_t from, uint32_t to, uint32_t n) const;
+        // bit updates, the lock of the cluster's group is held
+        void take(Group& group, uint32_t cluster);
+        void give_back(Group& group, uint32_t cluster);
+
+    public:
+        ClusterAllocator() : group_cnt(0), first(0), limit(0), free_cnt(0) {}
+
+        void reset(uint32_t first_cluster, uint32_t cluster_limit);
+        void mark_used(uint32_t cluster);
+        void mark_free(uint32_t cluster);
+        bool is_free(uint32_t cluster);
+
+        // Returns the reserved cluster, or -1 when the volume is full
+        int allocate();
+        // Reserves n consecutive clusters and returns the first one, or -1
+        int allocate_contiguous(uint32_t n);
+
+        uint32_t free_count() const { return free_cnt.load(std::memory_order_relaxed); }
+        uint32_t cluster_limit() const { return limit; }
+    };
+
+}//namespace
+
+#endif
@@ -122,14 +122,16 @@ namespace fat12 {
     // Default paramters of boot sector 
     const uint16_t DEFAULT_BYTSPERSEC = 512;
     const uint8_t  DEFAULT_SECPERCLUS = 1;
-    const uint8_t  DEFAULT_BLOCK_SIZE = static_cast<uint8_t>(DEFAULT_BYTSPERSEC * DEFAULT_SECPERCLUS); 
     const uint16_t DEFAULT_RSVDSECCNT = 1;
     const uint16_t DEFAULT_NUMFATS    = 2;
     const uint8_t  DEFAULT_ROOTENTCNT = 224;
-    const uint16_t DEFAULT_FAT12_SIZE = 9; // 9 sectors
+    const uint16_t FAT16_ROOTENTCNT   = 512;
+    const uint32_t DEFAULT_BLOCK_CNT  = 1 << 12;
+    const uint16_t MIN_CLUSTER_SIZE   = 512;
+    const uint32_t MAX_CLUSTER_SIZE   = 32 * 1024;
     const uint8_t  MEDIA_REMOVABLE = 0xF0;
     const uint8_t  MEDIA_NONREMOVABLE = 0xF8;
-    const uint16_t EOC_MARKER = 0xFFF;
+    const uint16_t EOC_MARKER = 0xFFFF;
 
 
     #pragma pack(push, 1)
@@ -167,16 +169,18 @@ namespace fat12 {
 
 
     // Define FAT entry data type as uint16_t
+    // Marker values are in their FAT16 form, FAT12 tables are widened on
+    // decode (see fat12_fat_codec.hpp)
     using FatEntry = uint16_t;
     
     const int FAT_RESERVED_CNT = 2; // First 2 fat entries are reserved
     const FatEntry FAT_ENTRY_UNUSED = 0x00;
-    const FatEntry FAT_ENTRY_RESERVED_CLUSTER_START = 0xFF0;
-    const FatEntry FAT_ENTRY_RESERVED_CLUSTER_END = 0xFF6;
-    const FatEntry FAT_ENTRY_RESERVED_CLUSTER = 0xFF6;
-    const FatEntry FAT_ENTRY_BAD_CLUSTER = 0xFF7;
-    const FatEntry FAT_ENTRY_LAST_CLUSTER_START = 0xFF8;
-    const FatEntry FAT_ENTRY_LAST_CLUSTER_END = 0xFFF;
+    const FatEntry FAT_ENTRY_RESERVED_CLUSTER_START = 0xFFF0;
+    const FatEntry FAT_ENTRY_RESERVED_CLUSTER_END = 0xFFF6;
+    const FatEntry FAT_ENTRY_RESERVED_CLUSTER = 0xFFF6;
+    const FatEntry FAT_ENTRY_BAD_CLUSTER = 0xFFF7;
+    const FatEntry FAT_ENTRY_LAST_CLUSTER_START = 0xFFF8;
+    const FatEntry FAT_ENTRY_LAST_CLUSTER_END = 0xFFFF;
 
 }
 
@@ -0,0 +1,84 @@
+#ifndef FAT12_DENTRY_CACHE_HPP
+#define FAT12_DENTRY_CACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+using std::string;
+
+namespace fat12 {
+
+    /*
+        Path resolution cache, similar to a dentry cache.
+        Maps normalized absolute paths and (parent cluster, name) pairs to
+        the location of the directory entry, stored as a byte offset into
+        the image so it survives nothing but the current mount.
+        Only positive lookups are cached, so creating an entry never makes
+        the cache stale; deleting, renaming or moving an entry must call
+        forget(). Every call takes an internal mutex, so lookups running
+        in parallel under the file system's shared lock can fill it.
+    */
+    class DentryCache {
+    private:
+        std::unordered_map<string, size_t> paths;
+        std::unordered_map<string, size_t> children;
+        mutable std::mutex lock;
+
+        static string child_key(uint16_t parent_cluster, const string& name) {
+            string key(reinterpret_cast<const char*>(&parent_cluster), sizeof(parent_cluster));
+            return key + name;
+        }
+
+    public:
+        bool find_path(const string& path, size_t& offset) const {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = paths.find(path);
+            if (it == paths.end())
+                return false;
+            offset = it->second;
+            return true;
+        }
+
+        bool find_child(uint16_t parent_cluster, const string& name, size_t& offset) const {
+            string key = child_key(parent_cluster, name);
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = children.find(key);
+            if (it == children.end())
+                return false;
+            offset = it->second;
+            return true;
+        }
+
+        void add_path(const string& path, size_t offset) {
+            std::lock_guard<std::mutex> guard(lock);
+            paths[path] = offset;
+        }
+
+        void add_child(uint16_t parent_cluster, const string& name, size_t offset) {
+            string key = child_key(parent_cluster, name);
+            std::lock_guard<std::mutex> guard(lock);
+            children[key] = offset;
+        }
+
+        // An entry went away or moved: drop it and every cached path, since
+        // any of them may run through it
+        void forget(uint16_t parent_cluster, const string& name) {
+            string key = child_key(parent_cluster, name);
+            std::lock_guard<std::mutex> guard(lock);
+            children.erase(key);
+            paths.clear();
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> guard(lock);
+            paths.clear();
+            children.clear();
+        }
+    };
+
+}//namespace
+
+#endif
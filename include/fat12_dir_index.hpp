@@ -0,0 +1,42 @@
+#ifndef FAT12_DIR_INDEX_HPP
+#define FAT12_DIR_INDEX_HPP
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using std::string;
+
+namespace fat12 {
+
+    /*
+        In-memory index of a single directory, built on first access.
+        Maps child names to the offset of their slot in the image and keeps
+        the free slots sorted, so child lookup and slot allocation don't
+        scan the directory.
+    */
+    class DirIndex {
+    private:
+        std::unordered_map<string, size_t> names;
+        std::vector<size_t> free_slots; // descending, back() is the lowest slot
+
+    public:
+        void add(const string& name, size_t offset) { names[name] = offset; }
+        void add_free(size_t offset);
+
+        bool find(const string& name, size_t& offset) const;
+        bool first_free(size_t& offset) const;
+
+        // A free slot now holds name
+        void take(size_t offset, const string& name);
+        // The slot holding name was freed
+        void release(const string& name);
+
+        size_t size() const { return names.size(); }
+        size_t free_count() const { return free_slots.size(); }
+    };
+
+}//namespace
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef FAT12_DIR_ITERATOR_HPP
+#define FAT12_DIR_ITERATOR_HPP
+
+#include <cstddef>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+#include "fat12_data_types.hpp"
+#include "fat12_stats.hpp"
+
+namespace fat12 {
+
+    // Where a directory's slots live: the fixed root region or a cluster chain
+    struct DirLayout {
+        DirectoryEntry* root;     // root region, nullptr for a chained directory
+        int root_cnt;
+        const FatEntry* fat;
+        uint8_t* data_area;       // cluster 2 starts here
+        size_t cluster_size;
+        int slots_per_cluster;
+        int cluster_cnt;
+        Stats* stats;
+    };
+
+    /*
+        Forward iterator over the live entries of one directory. Free and
+        deleted slots are skipped, and a slot starting with 0x00 ends the
+        directory as in FAT: slots are always taken lowest first, so nothing
+        live follows it. A value type, copying it never allocates.
+        Slots are counted into STAT_DIR_ENTRIES_SCANNED per region loaded.
+    */
+    class DirIterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef DirectoryEntry value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef DirectoryEntry* pointer;
+        typedef DirectoryEntry& reference;
+
+        DirIterator() : layout(), slot(nullptr), slot_end(nullptr), cluster(0), hops(0) {}
+
+        DirIterator(const DirLayout& layout, uint16_t start)
+            : layout(layout), slot(nullptr), slot_end(nullptr), cluster(start), hops(0) {
+            if (layout.root != nullptr) {
+                load(layout.root, layout.root_cnt);
+            }
+            else {
+                check_cluster(start);
+                load_cluster();
+            }
+            settle();
+        }
+
+        reference operator*() const { return *slot; }
+        pointer operator->() const { return slot; }
+
+        DirIterator& operator++() {
+            ++slot;
+            settle();
+            return *this;
+        }
+
+        DirIterator operator++(int) {
+            DirIterator prev = *this;
+            ++*this;
+            return prev;
+        }
+
+        bool operator==(const DirIterator& other) const { return slot == other.slot; }
+        bool operator!=(const DirIterator& other) const { return slot != other.slot; }
+
+    private:
+        DirLayout layout;
+        DirectoryEntry* slot;     // nullptr once past the end
+        DirectoryEntry* slot_end;
+        uint16_t cluster;
+        int hops;
+
+        void load(DirectoryEntry* first, int cnt) {
+            slot = first;
+            slot_end = first + cnt;
+            layout.stats->add(STAT_DIR_ENTRIES_SCANNED, cnt);
+        }
+
+        void load_cluster() {
+            auto first = reinterpret_cast<DirectoryEntry*>(
+                layout.data_area + static_cast<size_t>(cluster - FAT_RESERVED_CNT) * layout.cluster_size);
+            load(first, layout.slots_per_cluster);
+        }
+
+        void check_cluster(uint16_t c) {
+            if (c < FAT_RESERVED_CNT || c >= layout.cluster_cnt || hops++ >= layout.cluster_cnt)
+                throw std::runtime_error("Corrupted cluster chain at cluster " + std::to_string(c));
+        }
+
+        // Advance to the next live slot, following the chain as needed
+        void settle() {
+            while (true) {
+                for (; slot != slot_end; ++slot) {
+                    unsigned char first = static_cast<unsigned char>(slot->filename[0]);
+                    if (first == DIR_NAME_FREE[1]) {
+                        slot = nullptr; // end of directory
+                        return;
+                    }
+                    if (first != DIR_NAME_FREE[0])
+                        return;
+                }
+
+                if (layout.root != nullptr) {
+                    slot = nullptr;
+                    return;
+                }
+                layout.stats->add(STAT_FAT_LOOKUPS);
+                FatEntry next = layout.fat[cluster];
+                if (next >= FAT_ENTRY_LAST_CLUSTER_START) {
+                    slot = nullptr;
+                    return;
+                }
+                check_cluster(next);
+                cluster = next;
+                load_cluster();
+            }
+        }
+    };
+
+    // begin()/end() pair over a directory for range-for
+    class DirRange {
+    public:
+        DirRange(const DirLayout& layout, uint16_t start) : first(layout, start) {}
+        DirIterator begin() const { return first; }
+        DirIterator end() const { return DirIterator(); }
+
+    private:
+        DirIterator first;
+    };
+
+}//namespace
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef FAT12_DIR_SCAN_HPP
+#define FAT12_DIR_SCAN_HPP
+
+#include <string>
+
+#include "fat12_data_types.hpp"
+
+using std::string;
+
+namespace fat12 {
+
+    /*
+        Slot scanners over a contiguous block of directory entries. The AVX2
+        kernels gather the leading bytes of eight 32-byte entries per
+        instruction and only look at whole entries on a hit; other CPUs use
+        a scalar loop. Both return the index of the first match or -1.
+    */
+
+    // First slot that is free (0x00) or deleted (0xE5)
+    int find_free_slot(const DirectoryEntry* slots, int cnt);
+
+    // First slot whose 11-byte name field equals key (see make_name_key)
+    int find_name_slot(const DirectoryEntry* slots, int cnt, const char* key);
+
+    // The scalar kernels whatever the CPU, to check the AVX2 ones against
+    int find_free_slot_scalar(const DirectoryEntry* slots, int cnt);
+    int find_name_slot_scalar(const DirectoryEntry* slots, int cnt, const char* key);
+
+    // NUL padded 11-byte form of name, as stored by set_entry_name()
+    void make_name_key(const string& name, char* key);
+
+    // Name of the kernels in use: "avx2" or "scalar"
+    const char* dir_scan_kernel_name();
+
+}//namespace
+
+#endif
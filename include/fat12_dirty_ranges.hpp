@@ -0,0 +1,33 @@
+#ifndef FAT12_DIRTY_RANGES_HPP
+#define FAT12_DIRTY_RANGES_HPP
+
+#include <cstddef>
+#include <iterator>
+#include <map>
+
+namespace fat12 {
+
+    /*
+        Byte ranges of the image modified since the last flush.
+        Ranges are kept sorted and overlapping or touching ranges are merged
+        on insertion, so a flush needs one positioned write per range.
+    */
+    class DirtyRanges {
+    private:
+        std::map<size_t, size_t> ranges; // start offset -> end offset (exclusive)
+
+    public:
+        void add(size_t offset, size_t len);
+        void clear() { ranges.clear(); }
+        bool empty() const { return ranges.empty(); }
+        size_t count() const { return ranges.size(); }
+        size_t bytes() const;
+
+        typedef std::map<size_t, size_t>::const_iterator const_iterator;
+        const_iterator begin() const { return ranges.begin(); }
+        const_iterator end() const { return ranges.end(); }
+    };
+
+}//namespace
+
+#endif
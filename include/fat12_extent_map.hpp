@@ -0,0 +1,55 @@
+#ifndef FAT12_EXTENT_MAP_HPP
+#define FAT12_EXTENT_MAP_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "fat12_data_types.hpp"
+
+namespace fat12 {
+
+    // Physically consecutive clusters holding logical blocks [logical, logical + count)
+    struct Extent {
+        uint32_t logical;
+        uint16_t start;
+        uint16_t count;
+    };
+
+    /*
+        Logical block -> cluster map of one file, built once from its FAT
+        chain. A contiguous file is a single extent, so offset lookups are
+        a binary search over a handful of entries instead of a walk of the
+        chain. append() and truncate() keep it in step with the chain;
+        any other change to the chain must drop the map.
+    */
+    class ExtentMap {
+    private:
+        std::vector<Extent> runs;
+        uint32_t blocks;
+
+    public:
+        ExtentMap() : blocks(0) {}
+
+        // Walk the chain from start, returns the number of FAT hops.
+        // Throws on a chain that leaves [2, cluster_cnt) or loops.
+        uint32_t build(const FatEntry* fat, int cluster_cnt, uint16_t start);
+
+        // Index of the extent holding block, size() of extents() past the end
+        size_t find(uint32_t block) const;
+        // Cluster holding block, 0 past the end
+        uint16_t cluster_at(uint32_t block) const;
+
+        // Chain grew by one cluster at its tail
+        void append(uint16_t cluster);
+        // Chain was cut to its first cnt clusters
+        void truncate(uint32_t cnt);
+
+        const std::vector<Extent>& extents() const { return runs; }
+        uint32_t block_count() const { return blocks; }
+        uint16_t last_cluster() const { return runs.empty() ? 0 : runs.back().start + runs.back().count - 1; }
+    };
+
+}//namespace
+
+#endif
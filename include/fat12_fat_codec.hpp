@@ -0,0 +1,58 @@
+#ifndef FAT12_FAT_CODEC_HPP
+#define FAT12_FAT_CODEC_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "fat12_data_types.hpp"
+
+namespace fat12 {
+
+    /*
+        On-disk FAT12 tables pack two 12-bit entries into three bytes:
+            entry 2k   = byte[3k]          | (byte[3k+1] & 0x0F) << 8
+            entry 2k+1 = byte[3k+1] >> 4   |  byte[3k+2] << 4
+        The file system works on a decoded 16-bit shadow table and only
+        touches the packed form at mount (decode_fat12) and at flush
+        (encode_fat12 over the changed entry ranges). Marker values
+        (0xFF0-0xFFF) are widened to their FAT16 form on decode and
+        narrowed back on encode, so the shadow table reads the same for
+        both FAT widths.
+
+        FAT16 tables are plain little-endian 16-bit entries.
+    */
+
+    // The width follows the data cluster count, as in the FAT specification
+    const uint32_t FAT16_MIN_CLUSTERS = 4085;
+    const uint32_t FAT16_MAX_CLUSTERS = 65524;
+
+    // First entry index that collides with the marker values of each width
+    const FatEntry FAT12_ENTRY_LIMIT = 0xFF0;
+    const FatEntry FAT16_ENTRY_LIMIT = 0xFFF0;
+
+    // Bytes needed to hold cnt packed entries
+    inline size_t packed_fat_size(size_t cnt) { return (cnt * 3 + 1) / 2; }
+
+    FatEntry get_packed_entry(const uint8_t* packed, size_t idx);
+    void set_packed_entry(uint8_t* packed, size_t idx, FatEntry value);
+
+    // Decode cnt entries, picks the widest SIMD kernel the CPU supports
+    void decode_fat12(const uint8_t* packed, FatEntry* table, size_t cnt);
+
+    // Encode table entries [first, last) into their packed bytes
+    void encode_fat12(const FatEntry* table, uint8_t* packed, size_t first, size_t last);
+
+    // Width dispatch over the FAT12 and FAT16 codecs, fat_bits is 12 or 16
+    inline size_t fat_table_size(int fat_bits, size_t cnt) { return (cnt * fat_bits + 7) / 8; }
+    inline size_t fat_table_offset(int fat_bits, size_t idx) { return idx * fat_bits / 8; }
+    FatEntry get_fat_entry(int fat_bits, const uint8_t* packed, size_t idx);
+    void set_fat_entry(int fat_bits, uint8_t* packed, size_t idx, FatEntry value);
+    void decode_fat(int fat_bits, const uint8_t* packed, FatEntry* table, size_t cnt);
+    void encode_fat(int fat_bits, const FatEntry* table, uint8_t* packed, size_t first, size_t last);
+
+    // Name of the decode kernel in use: "avx2", "ssse3" or "scalar"
+    const char* fat_decoder_name();
+
+}//namespace
+
+#endif
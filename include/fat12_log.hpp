@@ -0,0 +1,59 @@
+#ifndef FAT12_LOG_HPP
+#define FAT12_LOG_HPP
+
+#include <ostream>
+#include <sstream>
+
+/*
+    Leveled diagnostics, written to stderr so they never mix with command
+    output. Messages above FAT12_LOG_MAX_LEVEL are removed at compile time,
+    including the evaluation of their arguments; the rest are filtered at
+    runtime by log_level(), which defaults to LOG_WARN and can be set with
+    the FAT12_LOG_LEVEL environment variable (error, warn, info, debug,
+    trace or 0-4). A message is formatted first and written in one
+    piece, so lines from concurrent threads don't interleave.
+*/
+
+namespace fat12 {
+
+    enum LogLevel {
+        LOG_ERROR = 0,
+        LOG_WARN  = 1,
+        LOG_INFO  = 2,
+        LOG_DEBUG = 3,
+        LOG_TRACE = 4
+    };
+
+    extern int current_log_level;
+
+    inline int log_level() { return current_log_level; }
+    void set_log_level(int level);
+    std::ostream& log_stream();
+
+}//namespace
+
+// Release builds (-DNDEBUG) drop debug and trace messages entirely
+#ifndef FAT12_LOG_MAX_LEVEL
+    #ifdef NDEBUG
+        #define FAT12_LOG_MAX_LEVEL 2
+    #else
+        #define FAT12_LOG_MAX_LEVEL 4
+    #endif
+#endif
+
+#define FAT12_LOG(level, expr) \
+    do { \
+        if ((level) <= FAT12_LOG_MAX_LEVEL && (level) <= fat12::log_level()) { \
+            std::ostringstream fat12_log_line; \
+            fat12_log_line << expr << '\n'; \
+            fat12::log_stream() << fat12_log_line.str(); \
+        } \
+    } while (0)
+
+#define FAT12_ERROR(expr) FAT12_LOG(fat12::LOG_ERROR, expr)
+#define FAT12_WARN(expr)  FAT12_LOG(fat12::LOG_WARN, expr)
+#define FAT12_INFO(expr)  FAT12_LOG(fat12::LOG_INFO, expr)
+#define FAT12_DEBUG(expr) FAT12_LOG(fat12::LOG_DEBUG, expr)
+#define FAT12_TRACE(expr) FAT12_LOG(fat12::LOG_TRACE, expr)
+
+#endif
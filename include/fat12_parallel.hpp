@@ -0,0 +1,68 @@
+#ifndef FAT12_PARALLEL_HPP
+#define FAT12_PARALLEL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace fat12 {
+
+    inline unsigned worker_count() {
+        unsigned n = std::thread::hardware_concurrency();
+        return n == 0 ? 1 : n;
+    }
+
+    /*
+        Run fn(begin, end) over [0, count) in chunks of at most grain items
+        on up to worker_count() threads. Chunks are handed out through an
+        atomic cursor so uneven work balances itself, and inputs of a single
+        chunk run inline on the calling thread. The first exception thrown
+        by fn is rethrown once every thread has joined.
+    */
+    template <typename Fn>
+    void parallel_for(size_t count, size_t grain, Fn fn) {
+        if (grain == 0)
+            grain = 1;
+        size_t chunks = (count + grain - 1) / grain;
+        if (chunks <= 1) {
+            if (count > 0)
+                fn(0, count);
+            return;
+        }
+
+        std::atomic<size_t> cursor(0);
+        std::exception_ptr error;
+        std::atomic<bool> failed(false);
+
+        auto worker = [&]() {
+            while (!failed) {
+                size_t begin = cursor.fetch_add(grain);
+                if (begin >= count)
+                    return;
+                size_t end = begin + grain < count ? begin + grain : count;
+                try {
+                    fn(begin, end);
+                } catch (...) {
+                    if (!failed.exchange(true))
+                        error = std::current_exception();
+                }
+            }
+        };
+
+        size_t thread_cnt = worker_count() < chunks ? worker_count() : chunks;
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < thread_cnt; ++i)
+            threads.emplace_back(worker);
+        worker();
+        for (auto& t : threads)
+            t.join();
+
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+}//namespace
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef FAT12_RWLOCK_HPP
+#define FAT12_RWLOCK_HPP
+
+#include <cstddef>
+#include <pthread.h>
+#include <stdexcept>
+
+namespace fat12 {
+
+    /*
+        Readers-writer lock over pthread_rwlock_t, C++11 has no
+        shared_mutex. On glibc writers are preferred, so a steady stream
+        of readers can't starve a mutating command. Not recursive: a
+        thread holding either side must not take it again.
+    */
+    class RwLock {
+    private:
+        pthread_rwlock_t lock;
+
+    public:
+        RwLock() {
+            pthread_rwlockattr_t attr;
+            pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+            pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+            int rc = pthread_rwlock_init(&lock, &attr);
+            pthread_rwlockattr_destroy(&attr);
+            if (rc != 0) {
+                throw std::runtime_error("Error creating a readers-writer lock");
+            }
+        }
+        ~RwLock() { pthread_rwlock_destroy(&lock); }
+
+        RwLock(const RwLock&) = delete;
+        RwLock& operator=(const RwLock&) = delete;
+
+        void lock_shared() { pthread_rwlock_rdlock(&lock); }
+        void lock_exclusive() { pthread_rwlock_wrlock(&lock); }
+        void unlock() { pthread_rwlock_unlock(&lock); }
+    };
+
+    // Holds an RwLock shared or exclusive for the current scope, or
+    // nothing when given no lock
+    class RwGuard {
+    private:
+        RwLock* lock;
+
+    public:
+        RwGuard(RwLock& lock, bool exclusive) : RwGuard(&lock, exclusive) {}
+
+        RwGuard(RwLock* lock, bool exclusive) : lock(lock) {
+            if (lock == nullptr)
+                return;
+            if (exclusive)
+                lock->lock_exclusive();
+            else
+                lock->lock_shared();
+        }
+        ~RwGuard() {
+            if (lock != nullptr)
+                lock->unlock();
+        }
+
+        RwGuard(const RwGuard&) = delete;
+        RwGuard& operator=(const RwGuard&) = delete;
+    };
+
+    // A fixed set of RwLocks shared by any number of keys
+    class StripedRwLock {
+    public:
+        static const size_t STRIPE_CNT = 64;
+
+        size_t stripe(size_t key) const { return key % STRIPE_CNT; }
+        RwLock& at(size_t stripe) { return stripes[stripe]; }
+
+    private:
+        RwLock stripes[STRIPE_CNT];
+    };
+
+    // Holds the stripes of one or two keys for the current scope. Two
+    // stripes are taken in index order, so threads can't deadlock on them.
+    class StripeGuard {
+    private:
+        StripedRwLock& locks;
+        size_t low;
+        size_t high;
+
+    public:
+        StripeGuard(StripedRwLock& locks, size_t key, bool exclusive)
+            : StripeGuard(locks, key, key, exclusive) {}
+
+        StripeGuard(StripedRwLock& locks, size_t key, size_t other_key, bool exclusive) : locks(locks) {
+            size_t a = locks.stripe(key), b = locks.stripe(other_key);
+            low = a < b ? a : b;
+            high = a < b ? b : a;
+            lock(low, exclusive);
+            if (high != low)
+                lock(high, exclusive);
+        }
+        ~StripeGuard() {
+            if (high != low)
+                locks.at(high).unlock();
+            locks.at(low).unlock();
+        }
+
+        StripeGuard(const StripeGuard&) = delete;
+        StripeGuard& operator=(const StripeGuard&) = delete;
+
+    private:
+        void lock(size_t stripe, bool exclusive) {
+            if (exclusive)
+                locks.at(stripe).lock_exclusive();
+            else
+                locks.at(stripe).lock_shared();
+        }
+    };
+
+}//namespace
+
+#endif
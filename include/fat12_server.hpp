@@ -0,0 +1,86 @@
+#ifndef FAT12_SERVER_HPP
+#define FAT12_SERVER_HPP
+
+#include <atomic>
+#include <ctime>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "fat12.hpp"
+
+using std::string;
+
+namespace fat12 {
+
+    // When mounted images are written back to disk
+    enum FlushPolicy {
+        FLUSH_PER_REQUEST,  // after every mutating request
+        FLUSH_PERIODIC,     // every flush_interval seconds
+        FLUSH_ON_SHUTDOWN   // only when the server stops
+    };
+
+    /*
+        Serves fat12_fs::dispatch() over a Unix domain socket.
+        Images stay mounted between requests, so clients don't pay for
+        process startup and read_fs() on every operation. Every client is
+        served on its own thread, so read-only requests against the same
+        image run in parallel under its shared lock (see fat12_fs).
+        Only the images added before run() are served, a request naming
+        any other file is refused.
+
+        Protocol, one request per line:
+            <image> <operation> [parameters]
+            <image> flush
+            shutdown
+        and one JSON object per line in response:
+            {"status":"ok","output":"..."}
+            {"status":"error","error":"..."}
+    */
+    class fat12_server {
+    private:
+        struct Client {
+            int fd;
+            string pending; // bytes received but not yet a full line
+            std::thread worker;
+            std::atomic<bool> done;
+
+            explicit Client(int fd) : fd(fd), done(false) {}
+        };
+
+        string socket_path;
+        FlushPolicy flush_policy;
+        int flush_interval;
+        int listen_fd;
+        int wake_fds[2]; // self-pipe, wakes run() for stop() and finished clients
+        std::atomic<bool> running;
+        std::time_t last_flush;
+
+        std::mutex images_lock;
+        std::map<string, fat12_fs*> images;
+        std::list<Client> clients; // only touched by the thread in run()
+
+        fat12_fs* mount(const string& image);
+        fat12_fs* find_image(const string& image);
+        void flush_all();
+        void wake();
+        void accept_client();
+        void reap_clients(bool all);
+        void client_loop(Client& client);
+        bool serve_client(Client& client);
+        string handle_request(const string& line);
+
+    public:
+        fat12_server(const string& socket_path, FlushPolicy policy, int flush_interval = 5);
+        ~fat12_server();
+
+        void add_image(const string& image) { mount(image); }
+        void run();
+        void stop();
+    };
+
+}//namespace
+
+#endif
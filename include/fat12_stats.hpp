@@ -0,0 +1,89 @@
+#ifndef FAT12_STATS_HPP
+#define FAT12_STATS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+using std::string;
+
+namespace fat12 {
+
+    enum StatCounter {
+        STAT_DIR_ENTRIES_SCANNED,
+        STAT_FAT_LOOKUPS,
+        STAT_CLUSTERS_ALLOCATED,
+        STAT_CLUSTERS_FREED,
+        STAT_BYTES_IN,
+        STAT_BYTES_OUT,
+        STAT_FLUSHES,
+        STAT_FLUSH_BYTES,
+        STAT_COUNTER_CNT
+    };
+
+    // Power-of-two latency buckets, bucket i holds samples below 2^i microseconds
+    class LatencyHistogram {
+    public:
+        static const int BUCKET_CNT = 32;
+
+        LatencyHistogram() : count(0), total_ns(0), max_ns(0), buckets() {}
+
+        void add(uint64_t ns);
+        uint64_t samples() const { return count; }
+        double mean_us() const { return count ? total_ns / 1000.0 / count : 0; }
+        double max_us() const { return max_ns / 1000.0; }
+        // upper bound of the bucket holding the p-th sample, 0 < p <= 1
+        double percentile_us(double p) const;
+
+    private:
+        uint64_t count;
+        uint64_t total_ns;
+        uint64_t max_ns;
+        uint64_t buckets[BUCKET_CNT];
+    };
+
+    /*
+        Operation counters and per-command latency histograms of a mount.
+        Disabled by default, every hook is then a single predictable branch.
+        Safe to update from concurrent readers: counters are relaxed
+        atomics and the histograms sit behind a mutex.
+    */
+    class Stats {
+    public:
+        Stats() : enabled(false) {
+            for (auto& counter : counters)
+                counter.store(0, std::memory_order_relaxed);
+        }
+
+        bool is_enabled() const { return enabled.load(std::memory_order_relaxed); }
+        void set_enabled(bool on) { enabled.store(on, std::memory_order_relaxed); }
+        void reset();
+
+        void add(StatCounter counter, uint64_t n = 1) {
+            if (is_enabled())
+                counters[counter].fetch_add(n, std::memory_order_relaxed);
+        }
+        void record(const string& command, uint64_t ns) {
+            if (is_enabled()) {
+                std::lock_guard<std::mutex> guard(commands_lock);
+                commands[command].add(ns);
+            }
+        }
+        uint64_t get(StatCounter counter) const { return counters[counter].load(std::memory_order_relaxed); }
+
+        void print(std::ostream& os) const;
+        void print_json(std::ostream& os) const;
+
+    private:
+        std::atomic<bool> enabled;
+        std::atomic<uint64_t> counters[STAT_COUNTER_CNT];
+        mutable std::mutex commands_lock;
+        std::map<string, LatencyHistogram> commands;
+    };
+
+}//namespace
+
+#endif
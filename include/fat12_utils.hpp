@@ -20,17 +20,31 @@ namespace fat12 {
     bool is_writable(const DirectoryEntry& entry);
     bool is_readable(const DirectoryEntry& entry);
 
+    // Names occupy the 11 bytes of filename + extension, NUL padded
+    const size_t ENTRY_NAME_LEN = 11;
+    void check_entry_name(const string& name);
+    bool entry_name_equals(const DirectoryEntry& entry, const string& name);
+    void set_entry_name(DirectoryEntry* entry, const string& name);
+    string entry_name(const DirectoryEntry& entry);
+
 
     bool is_reserved_cluster(uint16_t cluster);
     bool is_last_cluster(uint16_t cluster);
     void check_fat_idx(uint16_t idx);
     void set_time_date(Timestamp* ts);
+    void set_time_date(Timestamp* ts, std::time_t t);
     void get_time_date(const Timestamp* ts, std::tm* decoded_time);
+    std::time_t get_time(const Timestamp* ts);
     std::vector<string> tokenize(const string& path);
+    string json_escape(const string& str);
 
     // linux stuff
     string read_linux_file(const string& file_path);
     uint8_t read_linux_permissions(const string& file_path);
+    uint8_t linux_mode_attributes(mode_t mode);
+    mode_t attributes_linux_mode(uint8_t attributes);
+    // Read up to want bytes of fd into a run of run_bytes, zeroing the rest
+    size_t read_linux_run(int fd, char* dst, size_t want, size_t run_bytes, const string& file_path = "");
 
 
 }//namespace
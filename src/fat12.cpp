@@ -1,10 +1,26 @@
 
 #include "fat12.hpp"
 #include "fat12_utils.hpp"
+#include "fat12_log.hpp"
+#include <algorithm>
+#include <chrono>
 #include <ctime>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unordered_set>
+#include <unistd.h>
 
 namespace fat12 {
 
+    thread_local std::ostream* fat12_fs::call_out = nullptr;
+
+    static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
     std::ostream& operator<<(std::ostream& os, const BootSector& boot_sector) {
         os << "===================Boot Sector===============\n";
         os << "OEM Name: " << std::string(boot_sector.BS_OEMName, 8) << '\n';
@@ -27,9 +43,9 @@ namespace fat12 {
     // Overload the << operator for DirectoryEntry struct
     std::ostream& operator<<(std::ostream& os, const DirectoryEntry& entry) {
         os << "===================DirectoryEntry===============\n";
-        os << "Filename: " << entry.filename << std::endl;
-        os << "Extension: " << entry.extension << std::endl;
-        os << "Password: " << entry.password << std::endl;
+        os << "Filename: " << entry.filename << '\n';
+        os << "Extension: " << entry.extension << '\n';
+        os << "Password: " << entry.password << '\n';
 
         os << "Attributes: ";
         if (entry.attributes & ATTR_READABLE) os << "+R ";
@@ -38,7 +54,7 @@ namespace fat12 {
         if (entry.attributes & ATTR_VOLUME_ID) os << "Volume ID ";
         if (entry.attributes & ATTR_DIRECTORY) os << "Directory ";
         if (entry.attributes & ATTR_ARCHIVE) os << "Archive ";
-        os << std::endl;
+        os << '\n';
 
         std::tm tm_creation;
         std::tm tm_last_modified;
@@ -50,125 +66,223 @@ namespace fat12 {
         char buffer[100];
         // Format creation date, time
         std::strftime(buffer, sizeof(buffer), "%Y-%m-%d", &tm_creation);
-        os << "Creation Date: " << buffer << std::endl;
+        os << "Creation Date: " << buffer << '\n';
         std::strftime(buffer, sizeof(buffer), "%H:%M:%S", &tm_creation);
-        std::cout << "Creation Time: " << buffer << std::endl;
+        os << "Creation Time: " << buffer << '\n';
 
         // Format last modified date, time
         std::strftime(buffer, sizeof(buffer), "%Y-%m-%d", &tm_last_modified);
-        os << "Last Modificaiton Date: " << buffer << std::endl;
+        os << "Last Modificaiton Date: " << buffer << '\n';
         std::strftime(buffer, sizeof(buffer), "%H:%M:%S", &tm_last_modified);
-        std::cout << "Last Modificaiton Time: " << buffer << std::endl;
+        os << "Last Modificaiton Time: " << buffer << '\n';
 
 
-        os << "Starting Cluster: " << entry.starting_cluster << std::endl;
-        os << "File Size: " << entry.file_size << std::endl;
+        os << "Starting Cluster: " << entry.starting_cluster << '\n';
+        os << "File Size: " << entry.file_size << '\n';
         return os;
     }
 
+    // Write back only the regions modified since the image was loaded
     void fat12_fs::dump_fs() {
-        std::cout << "DUMP FILESYSTEM! size: " << total_size_bytes << std::endl;
+        RwGuard guard(fs_lock, true);
+        flush_fat();
+        FAT12_INFO("DUMP FILESYSTEM! dirty ranges: " << dirty.count()
+                  << ", bytes: " << dirty.bytes());
 
-        //traverse_all();
+        if (dirty.empty())
+            return;
+        stats.add(STAT_FLUSHES);
+        stats.add(STAT_FLUSH_BYTES, dirty.bytes());
+
+        if (mapped_size != 0) {
+            // Changes already live in the shared mapping, just schedule
+            // writeback of the touched pages
+            long page_size = sysconf(_SC_PAGESIZE);
+            for (auto& range : dirty) {
+                size_t start = range.first - (range.first % page_size);
+                if (msync(fs_buffer + start, range.second - start, MS_ASYNC) < 0) {
+                    throw std::runtime_error("Error syncing file system image: " + name + ": " + std::strerror(errno));
+                }
+            }
+            dirty.clear();
+            return;
+        }
 
-        std::ofstream ofs(name, std::ios::out | std::ios::binary);
-        if (!ofs.is_open()) {
-            throw std::invalid_argument("Error opening input file: " + name);
+        int fd = ::open(name.c_str(), O_WRONLY);
+        if (fd < 0) {
+            throw std::invalid_argument("Error opening input file: " + name + ": " + std::strerror(errno));
         }
 
-        ofs.write(fs_buffer, total_size_bytes);
-        ofs.close();
+        for (auto& range : dirty) {
+            size_t offset = range.first;
+            while (offset < range.second) {
+                ssize_t written = pwrite(fd, fs_buffer + offset, range.second - offset, offset);
+                if (written < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    ::close(fd);
+                    throw std::runtime_error("Error writing file system image: " + name + ": " + std::strerror(errno));
+                }
+                offset += written;
+            }
+        }
+        ::close(fd);
+        dirty.clear();
     }
 
     // this one uses current OS's api to create a file with an empty fat12 FS
-    void fat12_fs::create_fs(int size_kb) {
-
-        // Check if size_kb is either 0.5 or 1
-        if (size_kb != 0.5 && size_kb != 1) {
-            throw std::invalid_argument("The block size must be either 0.5 KB or 1 KB.");
+    void fat12_fs::create_fs(double size_kb, uint32_t block_cnt) {
+        RwGuard guard(fs_lock, true);
+
+        // Cluster sizes are powers of two from 0.5 KB to 32 KB
+        uint32_t cluster_size = static_cast<uint32_t>(size_kb * 1024);
+        if (cluster_size * 1.0 != size_kb * 1024 || cluster_size < MIN_CLUSTER_SIZE ||
+                cluster_size > MAX_CLUSTER_SIZE || (cluster_size & (cluster_size - 1)) != 0) {
+            throw std::invalid_argument("The block size must be a power of two between 0.5 KB and 32 KB.");
         }
 
+        // Formatting options
+        this->block_size_byte = cluster_size; // cluster is synonym of block in FAT
+        this->number_of_blocks = block_cnt;
+        this->total_size_bytes = static_cast<size_t>(block_size_byte) * block_cnt;
+        this->total_size_kb = this->total_size_bytes / 1024;
+
+        // Only the reserved sector, the FATs and the root directory are
+        // written, the data area is left as a hole that reads back as zeros
+        std::vector<char> metadata;
+        format(metadata);
+
         // Open a file for output operation and in binary mode
         std::ofstream ofs(name, std::ios::out | std::ios::binary);
         if (!ofs.is_open()) {
             throw std::invalid_argument("Error opening input file: " + name);
         }
-
-        // Formatting options
-        this->block_size_byte = size_kb * 1024 * DEFAULT_SECPERCLUS; // cluster is synonym of block in FAT
-        this->total_size_bytes = block_size_byte * (1 << 12);
-        this->total_size_kb = this->total_size_bytes / 1024;
-        this->number_of_blocks = total_size_bytes / block_size_byte;
-
-        // Create a file system buffer initialized with zeros
-        fs_buffer = new char[total_size_bytes];
-        format(fs_buffer);
-        ofs.write(fs_buffer, total_size_bytes);
+        ofs.write(metadata.data(), metadata.size());
         ofs.close();
-
-        std::cout << "Created file system: " << name << " with a size of " << total_size_kb << "KB" << std::endl;
-        std::cout << "Number of Blocks: " << number_of_blocks << std::endl;
-        std::cout << "Block Size (Bytes): " << block_size_byte << std::endl;
-        std::cout << "Total Size (Bytes): " << total_size_bytes << std::endl;
-        std::cout << "Total Size (KB): " << total_size_kb << std::endl;
+        if (ofs.fail() || ::truncate(name.c_str(), total_size_bytes) < 0) {
+            throw std::runtime_error("Error writing file system: " + name);
+        }
+        release_fs_buffer();
+        dirty.clear();
+
+        output() << "Created file system: " << name << " with a size of " << total_size_kb << "KB" << '\n';
+        output() << "FAT Type: FAT" << fat_bits << '\n';
+        output() << "Number of Blocks: " << number_of_blocks << '\n';
+        output() << "Block Size (Bytes): " << block_size_byte << '\n';
+        output() << "Total Size (Bytes): " << total_size_bytes << '\n';
+        output() << "Total Size (KB): " << total_size_kb << '\n';
     }
 
-    void fat12_fs::format(char* buffer) {
+    // Lay out and fill the metadata regions of a new volume, buffer ends
+    // where the data area starts
+    void fat12_fs::format(std::vector<char>& buffer) {
+        // Clusters up to 1 KB are a single sector as before, larger ones
+        // are made of 512 byte sectors
+        uint16_t bytes_per_sec = block_size_byte <= 1024 ? block_size_byte : DEFAULT_BYTSPERSEC;
+        uint32_t sec_per_clus = block_size_byte / bytes_per_sec;
+        uint32_t total_secs = number_of_blocks * sec_per_clus;
+
+        // FAT12 unless that leaves FAT16_MIN_CLUSTERS or more data clusters,
+        // the same rule parse_fs() uses to pick the width back up
+        uint16_t root_cnt = 0, rsvd_secs = 0, fat_secs = 0;
+        uint32_t meta_secs = 0, data_clusters = 0;
+        auto plan = [&](int bits) {
+            fat_bits = bits;
+            root_cnt = bits == 12 ? DEFAULT_ROOTENTCNT : FAT16_ROOTENTCNT;
+            uint32_t root_secs = root_cnt * sizeof(DirectoryEntry) / bytes_per_sec;
+            // One FAT must hold an entry for every block plus the reserved ones
+            size_t fat_bytes = fat_table_size(bits, number_of_blocks + FAT_RESERVED_CNT);
+            fat_secs = (fat_bytes + bytes_per_sec - 1) / bytes_per_sec;
+
+            // pad the reserved region so the data area starts on a cluster boundary
+            meta_secs = DEFAULT_RSVDSECCNT + DEFAULT_NUMFATS * fat_secs + root_secs;
+            rsvd_secs = DEFAULT_RSVDSECCNT + (sec_per_clus - meta_secs % sec_per_clus) % sec_per_clus;
+            meta_secs += rsvd_secs - DEFAULT_RSVDSECCNT;
+
+            data_clusters = total_secs > meta_secs ? (total_secs - meta_secs) / sec_per_clus : 0;
+        };
+
+        plan(12);
+        if (data_clusters >= FAT16_MIN_CLUSTERS) {
+            plan(16);
+            if (data_clusters < FAT16_MIN_CLUSTERS) {
+                // too big for FAT12 but the larger FAT16 tables leave too
+                // few clusters: trim the volume to the largest FAT12 one
+                plan(12);
+                data_clusters = FAT12_ENTRY_LIMIT - FAT_RESERVED_CNT;
+                total_secs = meta_secs + data_clusters * sec_per_clus;
+                number_of_blocks = total_secs / sec_per_clus;
+                total_size_bytes = static_cast<size_t>(block_size_byte) * number_of_blocks;
+                total_size_kb = total_size_bytes / 1024;
+            }
+        }
+        if (data_clusters == 0) {
+            throw std::invalid_argument("Volume too small for its metadata");
+        }
+        if (data_clusters > FAT16_MAX_CLUSTERS) {
+            throw std::invalid_argument("Too many clusters for FAT16, use a larger block size");
+        }
+
         BootSector boot_sector = {
             {0x00, 0x00, 0x00},
             {'G', 'T', 'U', 'F', 'A', 'T', '1', '2'},
-            block_size_byte,        // BPB_BytsPerSec, standard in fat12
-            DEFAULT_SECPERCLUS,     // BPB_SecPerClus, cluster size(aka block size) is 1 (*BytsPerSec= 512 bytes), 
-            DEFAULT_RSVDSECCNT,     // BPB_RsvdSecCnt
+            bytes_per_sec,          // BPB_BytsPerSec
+            static_cast<uint8_t>(sec_per_clus), // BPB_SecPerClus, cluster size(aka block size) in sectors
+            rsvd_secs,              // BPB_RsvdSecCnt
             DEFAULT_NUMFATS,        // BPB_NumFATs
-            DEFAULT_ROOTENTCNT,     // BPB_RootEntCnt
-            this->number_of_blocks, // BPB_TotSec16
+            root_cnt,               // BPB_RootEntCnt
+            static_cast<uint16_t>(total_secs < 0x10000 ? total_secs : 0), // BPB_TotSec16
             MEDIA_NONREMOVABLE,        // BPB_Media
-            DEFAULT_FAT12_SIZE,     // BPB_FATSz16
+            fat_secs,               // BPB_FATSz16
             // since its a floppy disk beloe are all zeros 
             0,      // BPB_SecPerTrk
             0,      // BPB_NumHeads
             0,      // BPB_HiddSec
-            0       // BPB_TotSec32
+            total_secs < 0x10000 ? 0 : total_secs // BPB_TotSec32
         };
 
-        // Allocate Reserved Sector
-        std::memcpy(buffer, &boot_sector, sizeof(BootSector));
+        // Calculate the start of the FAT tables, the root directory and the data area
+        size_t fat_size = static_cast<size_t>(fat_secs) * bytes_per_sec;
+        size_t fat1_start = static_cast<size_t>(rsvd_secs) * bytes_per_sec;
+        size_t fat2_start = fat1_start + fat_size;
+        size_t root_dir_start = fat2_start + fat_size;
+        size_t data_area_start = root_dir_start + root_cnt * sizeof(DirectoryEntry);
+
+        // Everything starts out zeroed: free FAT entries and an empty (0x00) root
+        buffer.assign(data_area_start, 0);
 
-        // Allocate FAT tables
-        // Add offset to reach next region: FAT Tables
-        // Calculate the start of the FAT tables
-        size_t fat1_start = DEFAULT_RSVDSECCNT * DEFAULT_BYTSPERSEC;
-        size_t fat2_start = fat1_start + (DEFAULT_FAT12_SIZE * DEFAULT_BYTSPERSEC);
+        // Allocate Reserved Sector
+        std::memcpy(buffer.data(), &boot_sector, sizeof(BootSector));
 
         // Initialize FAT[0] and FAT[1]
         // First entry (media type) and second entry (EOC)
         // are reseved
-        FatEntry fat[3] = { MEDIA_NONREMOVABLE, 0x0FF, 0x0F0 };
-        std::memcpy(buffer + fat1_start, fat, sizeof(FatEntry));
-        std::memset(buffer + fat1_start + 4, FAT_ENTRY_UNUSED, (boot_sector.BPB_FATSz16 * boot_sector.BPB_BytsPerSec) - 4);
-
-        std::memcpy(buffer + fat2_start, fat, sizeof(FatEntry));
-        std::memset(buffer + fat2_start + 4, FAT_ENTRY_UNUSED, (boot_sector.BPB_FATSz16 * boot_sector.BPB_BytsPerSec) - 4);
-
-        // Calculate the start of the root directory
-        size_t root_dir_start = fat2_start + (DEFAULT_FAT12_SIZE * DEFAULT_BYTSPERSEC);
+        for (size_t start : {fat1_start, fat2_start}) {
+            uint8_t* fat = reinterpret_cast<uint8_t*>(buffer.data() + start);
+            set_fat_entry(fat_bits, fat, 0, 0xFF00 | boot_sector.BPB_Media);
+            set_fat_entry(fat_bits, fat, 1, EOC_MARKER);
+        }
 
-        // Initialize the root directory with empty entries (0x00)
-        // directory entries are 32 bytes
-        std::memset(buffer + root_dir_start, 0, DEFAULT_ROOTENTCNT * 32);
+        FAT12_INFO("Data Area start at byte: " << data_area_start);
+        FAT12_INFO("Data Area Size: " << (total_size_bytes - data_area_start) / 1024 << "KB");
+    }
 
-        // Calculate the start of the data area
-        size_t data_area_start = root_dir_start + (DEFAULT_ROOTENTCNT * 32);
+    void fat12_fs::read_fs() {
+        RwGuard guard(fs_lock, true);
+        release_fs_buffer();
+        dirty.clear();
+        fat_dirty.clear();
 
-        std::cout << "Data Area start at byte: " << data_area_start << std::endl;
-        std::cout << "Data Area Size: " << (total_size_bytes - data_area_start) / 1024 << "KB" << std::endl;
+        if (mmap_mode)
+            map_fs();
+        else
+            load_fs_buffer();
 
-        // Initialize the data area (optional, here we zero it out)
-        std::memset(buffer + data_area_start, 0, total_size_bytes - data_area_start);
+        parse_fs();
     }
 
-    void fat12_fs::read_fs() {
+    // Copy the whole image into a heap buffer, dump_fs() writes it back
+    void fat12_fs::load_fs_buffer() {
         std::ifstream fs(name, std::ios::in | std::ios::binary | std::ios::ate);
         if (!fs.is_open()) {
             throw std::invalid_argument("Error opening input file: " + name);
@@ -176,164 +290,315 @@ namespace fat12 {
 
         // Determine the file size
         std::streamsize file_size = fs.tellg();
-        std::cout << "File size: " << file_size / 1024 << "KB" << std::endl;
+        FAT12_DEBUG("File size: " << file_size / 1024 << "KB");
 
         // move pointer to beginning
         fs.seekg(0, std::ios::beg);
         fs_buffer = new char[file_size];
         this->total_size_bytes = file_size;
-        std::cout << "char buffer of size: " << file_size << std::endl;
+        FAT12_DEBUG("char buffer of size: " << file_size);
 
         // Read the entire file system image into the buffer
         if (!fs.read(fs_buffer, file_size)) {
-            std::cerr << "Failed to read file: " << name << std::endl;
             fs.close();
-            delete[] fs_buffer;
-            return;
+            release_fs_buffer();
+            throw std::runtime_error("Failed to read file: " + name);
         }
         fs.close();
+    }
+
+    // Map the image MAP_SHARED so reads are zero-copy and writes go straight
+    // to the page cache of the image file
+    void fat12_fs::map_fs() {
+        image_fd = ::open(name.c_str(), O_RDWR);
+        if (image_fd < 0) {
+            throw std::invalid_argument("Error opening input file: " + name + ": " + std::strerror(errno));
+        }
+
+        struct stat file_stat;
+        if (fstat(image_fd, &file_stat) < 0 || file_stat.st_size == 0) {
+            release_fs_buffer();
+            throw std::runtime_error("Invalid file system image: " + name);
+        }
+        FAT12_DEBUG("File size: " << file_stat.st_size / 1024 << "KB");
+
+        void* addr = mmap(nullptr, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
+        if (addr == MAP_FAILED) {
+            release_fs_buffer();
+            throw std::runtime_error("Failed to map file: " + name + ": " + std::strerror(errno));
+        }
+
+        fs_buffer = static_cast<char*>(addr);
+        mapped_size = file_stat.st_size;
+        this->total_size_bytes = file_stat.st_size;
+    }
+
+    void fat12_fs::release_fs_buffer() {
+        if (mapped_size != 0) {
+            munmap(fs_buffer, mapped_size);
+            mapped_size = 0;
+        }
+        else {
+            delete[] fs_buffer;
+        }
+        fs_buffer = nullptr;
 
+        if (image_fd >= 0) {
+            ::close(image_fd);
+            image_fd = -1;
+        }
+    }
+
+    // Set up region pointers over fs_buffer, whichever way it was loaded
+    void fat12_fs::parse_fs() {
         boot_sector = (BootSector*)fs_buffer; // reserved sector stars with superblock
-        std::cout << *boot_sector << std::endl;
+        FAT12_TRACE(*boot_sector);
 
+        if (boot_sector->BPB_BytsPerSec == 0 || boot_sector->BPB_SecPerClus == 0) {
+            throw std::runtime_error("Invalid file system image: " + name);
+        }
         block_size_byte = boot_sector->BPB_BytsPerSec * boot_sector->BPB_SecPerClus;
         fat_size_bytes = boot_sector->BPB_FATSz16 * boot_sector->BPB_BytsPerSec;
         entry_cnt_in_block = (unsigned long)block_size_byte / sizeof(DirectoryEntry);
 
-        std::cout << "block_size_byte: " << block_size_byte << std::endl;
-        std::cout << "fat_size_bytes: " << fat_size_bytes << std::endl;
-        std::cout << "entry_cnt_in_block: " << entry_cnt_in_block << std::endl;
-        std::cout << "sizeof(DirectoryEntry): " << sizeof(DirectoryEntry) << std::endl;
+        FAT12_DEBUG("block_size_byte: " << block_size_byte);
+        FAT12_DEBUG("fat_size_bytes: " << fat_size_bytes);
+        FAT12_DEBUG("entry_cnt_in_block: " << entry_cnt_in_block);
+        FAT12_DEBUG("sizeof(DirectoryEntry): " << sizeof(DirectoryEntry));
 
-        // Calculate the starting addresses
-        // TODO fat1_start  must be right after reserved area (a.k.a boot sector),
-        // BPB_BytsPerSec * BPB_RsvdSecCnt
-        // see format()
-        fat1_start = fat_size_bytes; 
+        // Calculate the starting addresses, FAT1 follows the reserved area
+        fat1_start = boot_sector->BPB_RsvdSecCnt * boot_sector->BPB_BytsPerSec;
         fat2_start = fat1_start + fat_size_bytes;
 
         root_dir_start = fat2_start + fat_size_bytes;
         data_area_start = root_dir_start + (boot_sector->BPB_RootEntCnt * 32);
 
         // Print the calculated addresses
-        std::cout << "FAT1 Start: " << fat1_start << std::endl;
-        std::cout << "FAT2 Start: " << fat2_start << std::endl;
-        std::cout << "Root Directory Start: " << root_dir_start << std::endl;
-        std::cout << "Data Area Start: " << data_area_start << std::endl;
+        FAT12_DEBUG("FAT1 Start: " << fat1_start);
+        FAT12_DEBUG("FAT2 Start: " << fat2_start);
+        FAT12_DEBUG("Root Directory Start: " << root_dir_start);
+        FAT12_DEBUG("Data Area Start: " << data_area_start);
 
-        // - Parse FAT tables
-        this->FAT = reinterpret_cast<FatEntry*>(&fs_buffer[fat1_start]);
+        if (static_cast<size_t>(data_area_start) > total_size_bytes || fat_size_bytes == 0) {
+            throw std::runtime_error("Invalid file system image: " + name);
+        }
         this->data_area = reinterpret_cast<uint8_t*>(&fs_buffer[data_area_start]);
 
+        // FAT width from the data cluster count the boot sector describes
+        uint32_t total_secs = boot_sector->BPB_TotSec16 != 0 ? boot_sector->BPB_TotSec16 : boot_sector->BPB_TotSec32;
+        uint32_t meta_secs = (data_area_start + boot_sector->BPB_BytsPerSec - 1) / boot_sector->BPB_BytsPerSec;
+        uint32_t data_clusters = total_secs > meta_secs ? (total_secs - meta_secs) / boot_sector->BPB_SecPerClus : 0;
+        fat_bits = data_clusters < FAT16_MIN_CLUSTERS ? 12 : 16;
+
+        // Usable clusters are bounded by the FAT size, the image size and
+        // the highest cluster number below the marker values
+        int fat_entry_cnt = fat_size_bytes * 8 / fat_bits;
+        int data_fit_cnt = (total_size_bytes - data_area_start) / block_size_byte + FAT_RESERVED_CNT;
+        int entry_limit = fat_bits == 12 ? FAT12_ENTRY_LIMIT : FAT16_ENTRY_LIMIT;
+        cluster_cnt = std::min(std::min(fat_entry_cnt, data_fit_cnt), entry_limit);
+
+        // - Decode FAT1 into the shadow table
+        FAT.resize(cluster_cnt);
+        decode_fat(fat_bits, reinterpret_cast<uint8_t*>(&fs_buffer[fat1_start]), FAT.data(), cluster_cnt);
+        FAT12_DEBUG("Decoded " << cluster_cnt << " FAT" << fat_bits << " entries ("
+                    << (fat_bits == 12 ? fat_decoder_name() : "scalar") << ")");
+        build_allocator();
+
         // Parse root directory entries
         this->root = reinterpret_cast<DirectoryEntry*>(&fs_buffer[root_dir_start]);
-        for (int i = 0; i < boot_sector->BPB_RootEntCnt; ++i) {
-            if (!is_entry_free(root[i]))
-            {
-                std::cout << i << "th Directory:\n" << root[i] << std::endl;
-                traverse(&root[i]);
-            }
-        }
+        std::memset(&root_dir, 0, sizeof(root_dir));
+        root_dir.filename[0] = '/';
+        root_dir.attributes = ATTR_DIRECTORY | ATTR_READABLE | ATTR_WRITABLE;
+        dentries.clear();
+        dir_indexes.clear();
+        extent_maps.clear();
+        open_files.clear();
 
         // - Access data area clusters
     }
 
-    void fat12_fs::operate(const string& operation, const string& param) {
-        std::cout << "Operating: " << operation << " " << param << std::endl;
+    bool fat12_fs::operate(const string& operation, const string& param) {
+        FAT12_DEBUG("Operating: " << operation << " " << param);
         try {
-            if ("mkdir" == operation) {
-                mkdir(param);
-            } 
-            else if ("dir" == operation)
-            {
-                dir(param);
-            }
-            else if ("write" == operation)
-            {
-                write(param);
-            }
-            else if ("read" == operation)
-            {
-                read(param);
-            }
-            else if ("chmod" == operation)
-            {
-                chmod(param);
-            }
-            else if ("dumpe2fs" == operation)
-            {
-                dumpe2fs();
-            }
-            
-            else {
-                throw std::runtime_error("Unsupported operation: " + operation);
-            }
+            dispatch(operation, param);
         } catch (const std::exception& e) {
-            std::cout << "Exception occurred: " << e.what() << std::endl;
+            FAT12_ERROR("Exception occurred: " << e.what());
+            return false;
         }
+        return true;
     }
 
-    // TODO check write permission
-    void fat12_fs::mkdir(const string& path) {
-        std::cout << "Processing mkdir " << path << std::endl;
-        auto tokens = tokenize(path);
-        // Initialize variables
-        bool duplicate = false;
-        DirectoryEntry* target_dir = root;
-        DirectoryEntry* empty_dir = nullptr;
-        string dir_name;
-        
-        // Trying to mkdir in root
-        if (tokens.size() == 1) {
-            dir_name = tokens[0];
-            std::cout << "Attempt to create directory " << dir_name << " in Root: " << root << std::endl;
-            for (int i = 0; i < boot_sector->BPB_RootEntCnt; ++i) {
-                //std::cout << "Loop: " << i << std::endl;
-                if (!is_entry_free(root[i])) {
-                    //std::cout << "Found existing directory!" << std::endl;
-                    if (root[i].filename == dir_name) {
-                        std::cout << "Found duplicate directory!" << std::endl;
-                        duplicate = true;
-                        break;
-                    }
-                }
-                else {
-                    empty_dir = &root[i];
-                }
-            }
+    // Run a single command, errors are reported as exceptions. fs_lock is
+    // held as lock_mode() says. The latency of every command but "stats"
+    // itself is recorded when stats are enabled.
+    void fat12_fs::dispatch(const string& operation, const string& param) {
+        LockMode mode = lock_mode(operation, param);
+        RwGuard guard(fs_lock, mode == MODE_EXCLUSIVE);
+        // creators must not change the tree under a whole-tree scan
+        RwGuard scan_guard(mode == MODE_SCAN || mode == MODE_CREATE ? &scan_lock : nullptr, mode == MODE_SCAN);
+        if (!stats.is_enabled() || "stats" == operation) {
+            run_command(operation, param);
+            return;
+        }
+
+        // names find_command() doesn't know share one histogram key, so
+        // clients sending arbitrary names can't grow the map
+        static const string unsupported = "unsupported";
+        const string& key = find_command(operation) != nullptr ? operation : unsupported;
+        auto start = std::chrono::steady_clock::now();
+        try {
+            run_command(operation, param);
+        } catch (...) {
+            stats.record(key, elapsed_ns(start));
+            throw;
+        }
+        stats.record(key, elapsed_ns(start));
+    }
+
+    void fat12_fs::dispatch(const string& operation, const string& param, std::ostream& os) {
+        std::ostream* previous = call_out;
+        call_out = &os;
+        try {
+            dispatch(operation, param);
+        } catch (...) {
+            call_out = previous;
+            throw;
+        }
+        call_out = previous;
+    }
+
+    fat12_fs::LockMode fat12_fs::lock_mode(const string& operation, const string& param) {
+        if (operation == "dir" || operation == "read")
+            return MODE_READ;
+        if (operation == "stats") // counters and histograms lock themselves
+            return MODE_READ;
+        if (operation == "dumpe2fs" || operation == "export")
+            return MODE_SCAN;
+        if (operation == "defrag" && (param == "report" || param == "-n"))
+            return MODE_SCAN;
+        if (operation == "mkdir" || operation == "write")
+            return MODE_CREATE;
+        return MODE_EXCLUSIVE;
+    }
+
+    bool fat12_fs::is_read_only(const string& operation, const string& param) {
+        LockMode mode = lock_mode(operation, param);
+        return mode == MODE_READ || mode == MODE_SCAN;
+    }
+
+    // Every command by name, run_command() and the stats keys go by this
+    const fat12_fs::Command* fat12_fs::find_command(const string& operation) {
+        static const Command commands[] = {
+            { "mkdir",    [](fat12_fs& fs, const string& param) { fs.mkdir(param); } },
+            { "dir",      [](fat12_fs& fs, const string& param) { fs.dir(param); } },
+            { "write",    [](fat12_fs& fs, const string& param) { fs.write(param); } },
+            { "read",     [](fat12_fs& fs, const string& param) { fs.read(param); } },
+            { "chmod",    [](fat12_fs& fs, const string& param) { fs.chmod(param); } },
+            { "del",      [](fat12_fs& fs, const string& param) { fs.del(param); } },
+            { "dumpe2fs", [](fat12_fs& fs, const string& param) { fs.dumpe2fs(param); } },
+            { "fsck",     [](fat12_fs& fs, const string& param) { fs.fsck(param); } },
+            { "import",   [](fat12_fs& fs, const string& param) { fs.import(param); } },
+            { "export",   [](fat12_fs& fs, const string& param) { fs.export_tree(param); } },
+            { "defrag",   [](fat12_fs& fs, const string& param) { fs.defrag(param); } },
+            { "stats",    [](fat12_fs& fs, const string& param) { fs.show_stats(param); } },
+        };
+        for (auto& command : commands) {
+            if (operation == command.name)
+                return &command;
+        }
+        return nullptr;
+    }
+
+    void fat12_fs::run_command(const string& operation, const string& param) {
+        const Command* command = find_command(operation);
+        if (command == nullptr) {
+            throw std::runtime_error("Unsupported operation: " + operation);
+        }
+        command->run(*this, param);
+    }
+
+    // "stats [json]" prints the counters, "stats on|off|reset" controls them
+    void fat12_fs::show_stats(const string& param) {
+        if (param.empty()) {
+            stats.print(output());
+        }
+        else if (param == "json" || param == "-j") {
+            stats.print_json(output());
+        }
+        else if (param == "on" || param == "off") {
+            stats.set_enabled(param == "on");
+        }
+        else if (param == "reset") {
+            stats.reset();
         }
         else {
-            DirectoryEntry* next_dir = root;
-            std::cout << "Search:" << next_dir->filename << std::endl;
-            for (auto& token : tokens) {
-                dir_name = token;
-                if (token != tokens[tokens.size() - 1])
-                {
-                    std::cout << "Looking for: " << token << " in: " << next_dir->filename << std::endl;
-                    auto found_dir = find_dir(next_dir, token);
-                    if (found_dir == nullptr)
-                        throw std::invalid_argument("Invalid folder path: " + token);
-                    else {
-                        std::cout << "Found dir: " << found_dir->filename << std::endl;
-                        next_dir = found_dir;
-                    }
-                }
+            throw std::invalid_argument("Usage: stats [json|on|off|reset]");
+        }
+    }
+
+    // Run one "operation parameters" pair per line against the mounted
+    // image. Blank lines and lines starting with '#' are skipped, a failing
+    // operation is reported and the batch goes on. Returns the failure count.
+    int fat12_fs::run_batch(std::istream& script) {
+        string line;
+        int line_no = 0;
+        int executed = 0;
+        int failed = 0;
+
+        while (std::getline(script, line)) {
+            ++line_no;
+            size_t start = line.find_first_not_of(" \t\r");
+            if (start == string::npos || line[start] == '#')
+                continue;
+
+            size_t op_end = line.find_first_of(" \t", start);
+            string operation = line.substr(start, op_end == string::npos ? string::npos : op_end - start);
+            string param;
+            if (op_end != string::npos) {
+                size_t param_start = line.find_first_not_of(" \t", op_end);
+                size_t param_end = line.find_last_not_of(" \t\r");
+                if (param_start != string::npos)
+                    param = line.substr(param_start, param_end - param_start + 1);
             }
-            target_dir = next_dir;
-            //target_dir = find_dir_recursive(tokens);
-            if (target_dir != nullptr) {
-                empty_dir = find_empty_dir(target_dir);
+
+            // accept shell style quoting, e.g. write "/usr/file1 data.txt"
+            if (param.size() >= 2 && param[0] == '"' && param[param.size() - 1] == '"')
+                param = param.substr(1, param.size() - 2);
+
+            ++executed;
+            if (!operate(operation, param)) {
+                ++failed;
+                FAT12_ERROR("line " << line_no << ": " << operation << " " << param << " failed");
             }
         }
-        std::cout << "Target dir: " << *target_dir << std::endl;
 
+        output() << "Batch completed: " << executed << " operations, " << failed << " failed" << '\n';
+        return failed;
+    }
+
+    // TODO check write permission
+    void fat12_fs::mkdir(const string& path) {
+        FAT12_DEBUG("Processing mkdir " << path);
+        auto tokens = tokenize(path);
+        string dir_name = tokens[tokens.size() - 1]; // last token
+        tokens.pop_back();
 
-        if (empty_dir != nullptr) {
-            create_dir(empty_dir, target_dir, dir_name);
+        DirectoryEntry* target_dir = find_dir_recursive(tokens);
+        if (target_dir == nullptr) {
+            throw std::invalid_argument("Invalid folder path: " + path);
         }
-        else {
-            std::cerr << "Couldn't find an empty directory under" << target_dir->filename << std::endl;
+        FAT12_TRACE("Target dir: " << *target_dir);
+
+        StripeGuard guard(dir_locks, dir_cluster(target_dir), parent_cluster(target_dir), true);
+        if (find_entry(target_dir, dir_name) != nullptr) {
+            throw std::invalid_argument("A file or directory with the same name exists: " + path);
+        }
+
+        DirectoryEntry* empty_dir = find_empty_dir(target_dir);
+        if (empty_dir == nullptr) {
+            throw std::runtime_error("No free directory entry for " + path);
         }
+        create_dir(empty_dir, target_dir, dir_name);
     }
 
     void fat12_fs::dir(const string& path) {
@@ -341,27 +606,16 @@ namespace fat12 {
 
         auto tokens = tokenize(path);
 
-        DirectoryEntry* target_dir = root;
-        string dir_name;
-
-        if (tokens.size() == 1 && tokens[0] == "")
-        {
-            // list root directory
-            for (int i = 0; i < boot_sector->BPB_RootEntCnt; ++i)
-                if (is_directory(root[i]))
-                    std::cout << root[i] << std::endl;
-        }
-        else {
+        DirectoryEntry* target_dir = &root_dir;
+        if (!(tokens.size() == 1 && tokens[0] == ""))
             target_dir = find_dir_recursive(tokens);
-            if (target_dir != nullptr) {
-                auto it = iterator(target_dir);
-                while (it->has_next()) {
-                    auto dir = it->next();
-                    if (!is_entry_free(*dir))
-                        std::cout << *dir << std::endl;
-                }
-            }
+        if (target_dir == nullptr) {
+            throw std::invalid_argument("Invalid folder path: " + path);
         }
+
+        StripeGuard guard(dir_locks, dir_cluster(target_dir), false);
+        for (auto& entry : entries(target_dir))
+            output() << entry << '\n';
     }
 
     void fat12_fs::write(const string& path) {
@@ -379,43 +633,82 @@ namespace fat12 {
             throw std::invalid_argument("Invalid arguments");
         }
         
-        std::cout << "Processing: " << tokens[0] << " , " << tokens[1] << std::endl;
+        FAT12_DEBUG("Processing: " << tokens[0] << " , " << tokens[1]);
         auto target_path = tokens[0];
 
-        string content = read_linux_file(tokens[1]);
+        int src_fd = ::open(tokens[1].c_str(), O_RDONLY);
+        if (src_fd < 0) {
+            throw std::invalid_argument("Error opening input file: " + tokens[1]);
+        }
 
-        std::cout << "File content to be copied:\n" << content << std::endl;
+        struct stat src_stat;
+        if (fstat(src_fd, &src_stat) < 0 || !S_ISREG(src_stat.st_mode)) {
+            ::close(src_fd);
+            throw std::invalid_argument("Not a regular file: " + tokens[1]);
+        }
+        FAT12_DEBUG("File size to be copied: " << src_stat.st_size);
 
         auto path_tokens = tokenize(target_path);
-        string& fname = path_tokens[path_tokens.size()-1]; // last token
+        string fname = path_tokens[path_tokens.size()-1]; // last token
         path_tokens.pop_back(); // remove last token, i.e file name
 
-        std::cout << "path_tokens size: " << path_tokens.size() << std::endl;
-        for (size_t i = 0; i < path_tokens.size(); i++)
-        {
-            std::cout << "i: " << path_tokens[i] << std::endl;
-        }
-        
-        DirectoryEntry* target_dir = root;
-        if (path_tokens.size() > 0)
-        {
-            target_dir = find_dir_recursive(path_tokens);
+        DirectoryEntry* target_dir = find_dir_recursive(path_tokens);
+        if (target_dir == nullptr) {
+            ::close(src_fd);
+            throw std::invalid_argument("Invalid folder path: " + target_path);
         }
-        std::cout << "Target dir: " << *target_dir << std::endl;
 
-        if (target_dir != nullptr) {
-            auto empty = find_empty_dir(target_dir); 
-            if (empty != nullptr) {
-                std::cout << "Empty: " << *empty << std::endl;
-                create_file(empty, target_dir, fname);
-                std::cout << "Updated Empty: " << *empty << std::endl;
-                // Copy linux permission
-                empty->attributes += read_linux_permissions(tokens[1]);
-                
-                // TODO we must check content size, and allocate depending on size
-                write_file(empty, content);
-            }   
+        FAT12_TRACE("Target dir: " << *target_dir);
+        StripeGuard guard(dir_locks, dir_cluster(target_dir), parent_cluster(target_dir), true);
+        auto empty = find_entry(target_dir, fname);
+        if (empty != nullptr) {
+            // overwrite an existing file in place
+            if (is_directory(*empty)) {
+                ::close(src_fd);
+                throw std::invalid_argument("A directory with the same name exists: " + target_path);
+            }
+            if (!is_writable(*empty)) {
+                ::close(src_fd);
+                throw std::runtime_error("Target file does not have write permission!");
+            }
+            if (is_open(empty)) {
+                ::close(src_fd);
+                throw std::runtime_error("File is open: " + target_path);
+            }
+
+            // the old chain is kept until the new one is filled
+            uint16_t old_start = empty->starting_cluster;
+            try {
+                write_file(empty, src_fd, src_stat.st_size);
+            } catch (...) {
+                ::close(src_fd);
+                throw;
+            }
+            if (old_start >= FAT_RESERVED_CNT)
+                free_chain(old_start);
+            empty->attributes = read_linux_permissions(tokens[1]);
+            mark_dirty(empty, sizeof(DirectoryEntry));
         }
+        else {
+            empty = find_empty_dir(target_dir);
+            if (empty == nullptr) {
+                ::close(src_fd);
+                throw std::runtime_error("No free directory entry for " + target_path);
+            }
+            create_file(empty, target_dir, fname);
+            // Copy linux permission
+            empty->attributes += read_linux_permissions(tokens[1]);
+
+            try {
+                write_file(empty, src_fd, src_stat.st_size);
+            } catch (...) {
+                // release the half created entry
+                release_slot(target_dir, empty, fname);
+                ::close(src_fd);
+                throw;
+            }
+        }
+        ::close(src_fd);
     }
 
     void fat12_fs::read(const string& path) {
@@ -433,48 +726,46 @@ namespace fat12 {
             throw std::invalid_argument("Invalid arguments");
         }
         
-        std::cout << "Processing: " << tokens[0] << " , " << tokens[1] << std::endl;
+        FAT12_DEBUG("Processing: " << tokens[0] << " , " << tokens[1]);
         auto fat_path = tokens[0];
         auto linux_file_path = tokens[1];
 
         auto path_tokens = tokenize(fat_path);
-        string& fname = path_tokens[path_tokens.size()-1]; // last token
+        string fname = path_tokens[path_tokens.size()-1]; // last token
         path_tokens.pop_back(); // remove last token, i.e file name
 
         auto target_dir = find_dir_recursive(path_tokens);
-        std::cout << "Target dir: " << *target_dir << std::endl;
-        if (target_dir != nullptr) {
-            auto it = iterator(target_dir);
-            while (it->has_next())
-            {
-                auto entry = it->next();
-                if (entry->filename == fname) {
-                    if (!is_readable(*entry)) {
-                        // TODO check parent readability as well.
-                        throw std::runtime_error("Target file does not have read permission!");
-                    }
-                    
-                    std::cout << "Found a file to read!" << std::endl;
-                    char* file_cluster_base = reinterpret_cast<char*>(&data_area[entry->starting_cluster]);
-        
-                    string file_content(file_cluster_base);
-                    std::cout << "Read file content: " << file_content << std::endl;
-
-                    std::cout << "Now write to a linux file!" << std::endl;
-                    std::ofstream outfile(linux_file_path);
+        if (target_dir == nullptr) {
+            throw std::invalid_argument("Invalid folder path: " + fat_path);
+        }
 
-                    // Check if the file is opened successfully
-                    if (!outfile.is_open()) {
-                        throw std::invalid_argument("Error opening file: " + linux_file_path);
-                    }
+        FAT12_TRACE("Target dir: " << *target_dir);
+        StripeGuard guard(dir_locks, dir_cluster(target_dir), false);
+        auto entry = find_entry(target_dir, fname);
+        if (entry != nullptr && is_file(*entry)) {
+            if (!is_readable(*entry)) {
+                // TODO check parent readability as well.
+                throw std::runtime_error("Target file does not have read permission!");
+            }
+            
+            FAT12_DEBUG("Found a file to read!");
+            int dst_fd = ::open(linux_file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-                    // Write the string to the file
-                    outfile << file_content;
+            // Check if the file is opened successfully
+            if (dst_fd < 0) {
+                throw std::invalid_argument("Error opening file: " + linux_file_path);
+            }
 
-                    // Close the file
-                    outfile.close();
-                }
+            try {
+                read_file(entry, dst_fd);
+            } catch (...) {
+                ::close(dst_fd);
+                throw;
             }
+            ::close(dst_fd);
+        }
+        else {
+            throw std::invalid_argument("No such file: " + fat_path);
         }
     }
 
@@ -493,7 +784,7 @@ namespace fat12 {
             throw std::invalid_argument("Invalid number of arguments: " + path);
         }
         
-        std::cout << "Processing: " << tokens[0] << " , " << tokens[1] << std::endl;
+        FAT12_DEBUG("Processing: " << tokens[0] << " , " << tokens[1]);
         auto fat_path = tokens[0];
         string permissions = tokens[1];
 
@@ -502,76 +793,313 @@ namespace fat12 {
         }
 
         auto path_tokens = tokenize(fat_path);
-        string& fname = path_tokens[path_tokens.size()-1]; // last token
+        string fname = path_tokens[path_tokens.size()-1]; // last token
         path_tokens.pop_back(); // remove last token, i.e file name
 
         auto target_dir = find_dir_recursive(path_tokens);
-        if (target_dir = nullptr) {
-            std::cout << "Directory search failed! " << fat_path << std::endl;
-            return;
+        if (target_dir == nullptr) {
+            throw std::invalid_argument("Invalid folder path: " + fat_path);
         }
         
-        std::cout << "Target dir: " << *target_dir << std::endl;
-        if (target_dir != nullptr) {
-            auto it = iterator(target_dir);
-            while (it->has_next())
-            {
-                auto entry = it->next();
-                if (entry->filename == fname) {
-                    std::cout << "Found the file to change permissions!" << std::endl;
-
-                    std::string permission = permissions.substr(0, 1);
-                    if (permission == "+") {
-                        std::cout << "The first character is +" << std::endl;
-                        for (size_t i = 1; i < permissions.size(); ++i) {
-                            if (permissions[i] == 'r') {
-                                std::cout << "Read permission granted on file " << fname << std::endl;
-                                entry->attributes |= ATTR_READABLE;
-                            } else if (permissions[i] == 'w') {
-                                std::cout << "Write permission granted on file " << fname << std::endl;
-                                entry->attributes |= ATTR_WRITABLE;
-                            }
-                        }
-                    } else if (permission == "-") {
-                        std::cout << "The first character is -" << std::endl;
-                        for (size_t i = 1; i < permissions.size(); ++i) {
-                            if (permissions[i] == 'r') {
-                                std::cout << "Read permission revoked on file " << fname << std::endl;
-                                entry->attributes &= ~ATTR_READABLE;
-                            } else if (permissions[i] == 'w') {
-                                std::cout << "Write permission revoked on file " << fname << std::endl;
-                                entry->attributes &= ~ATTR_WRITABLE;
-                            }
-                        }
+        FAT12_TRACE("Target dir: " << *target_dir);
+        auto entry = find_entry(target_dir, fname);
+        if (entry != nullptr) {
+            FAT12_DEBUG("Found the file to change permissions!");
+
+            std::string permission = permissions.substr(0, 1);
+            if (permission == "+") {
+                FAT12_DEBUG("The first character is +");
+                for (size_t i = 1; i < permissions.size(); ++i) {
+                    if (permissions[i] == 'r') {
+                        FAT12_INFO("Read permission granted on file " << fname);
+                        entry->attributes |= ATTR_READABLE;
+                    } else if (permissions[i] == 'w') {
+                        FAT12_INFO("Write permission granted on file " << fname);
+                        entry->attributes |= ATTR_WRITABLE;
+                    }
+                }
+            } else if (permission == "-") {
+                FAT12_DEBUG("The first character is -");
+                for (size_t i = 1; i < permissions.size(); ++i) {
+                    if (permissions[i] == 'r') {
+                        FAT12_INFO("Read permission revoked on file " << fname);
+                        entry->attributes &= ~ATTR_READABLE;
+                    } else if (permissions[i] == 'w') {
+                        FAT12_INFO("Write permission revoked on file " << fname);
+                        entry->attributes &= ~ATTR_WRITABLE;
                     }
                 }
             }
+            mark_dirty(&entry->attributes, sizeof(entry->attributes));
+        }
+        else {
+            throw std::invalid_argument("No such file: " + fat_path);
         }
     }
 
-    void fat12_fs::dumpe2fs() {
+    void fat12_fs::del(const string& path) {
+        auto path_tokens = tokenize(path);
+        string fname = path_tokens[path_tokens.size()-1]; // last token
+        path_tokens.pop_back(); // remove last token, i.e file name
+
+        auto target_dir = find_dir_recursive(path_tokens);
+        if (target_dir == nullptr) {
+            throw std::invalid_argument("Invalid folder path: " + path);
+        }
+
+        auto entry = find_entry(target_dir, fname);
+        if (entry == nullptr || !is_file(*entry)) {
+            throw std::invalid_argument("No such file: " + path);
+        }
+        if (is_open(entry)) {
+            throw std::runtime_error("File is open: " + path);
+        }
+
+        if (entry->starting_cluster >= FAT_RESERVED_CNT)
+            free_chain(entry->starting_cluster);
+        release_slot(target_dir, entry, fname);
+        set_time_date(&(target_dir->last_modification));
+        mark_dirty(target_dir, sizeof(DirectoryEntry));
+        FAT12_INFO("Deleted file: " << path);
+    }
+
+    // Usage report built from one pass over the FAT and one tree walk.
+    // The walk follows each chain once from its owner, filling a reverse
+    // cluster -> entry index; "-j" (or "json") prints it as JSON.
+    void fat12_fs::dumpe2fs(const string& param) {
+        bool json = (param == "-j" || param == "json");
+        if (!param.empty() && !json) {
+            throw std::invalid_argument("Usage: dumpe2fs [-j]");
+        }
+
+        // - Block usage, one linear pass over the shadow FAT
+        int free_cnt = 0;
+        int bad_cnt = 0;
+        for (int c = FAT_RESERVED_CNT; c < cluster_cnt; ++c) {
+            if (FAT[c] == FAT_ENTRY_UNUSED)
+                ++free_cnt;
+            else if (FAT[c] == FAT_ENTRY_BAD_CLUSTER)
+                ++bad_cnt;
+        }
+        int block_cnt = cluster_cnt - FAT_RESERVED_CNT;
+        int used_cnt = block_cnt - free_cnt - bad_cnt;
+
+        // - Reverse index, each cluster is claimed by the first chain reaching it
+        std::vector<DirectoryEntry*> entries;
+        std::vector<string> paths;
+        std::vector<std::vector<ClusterRun>> runs;
+        std::vector<int> owner(cluster_cnt, -1);
+        int owned_cnt = 0;
+        int file_cnt = 0;
+        int dir_cnt = 0;
+
+        walk_tree(&root_dir, "", [&](DirectoryEntry& entry, const string& path) {
+            int k = entries.size();
+            entries.push_back(&entry);
+            paths.push_back(path);
+            runs.push_back(std::vector<ClusterRun>());
+            is_directory(entry) ? ++dir_cnt : ++file_cnt;
+
+            uint16_t cluster = entry.starting_cluster;
+            while (cluster >= FAT_RESERVED_CNT && cluster < cluster_cnt && owner[cluster] < 0) {
+                owner[cluster] = k;
+                ++owned_cnt;
+                auto& chain = runs.back();
+                if (!chain.empty() && chain.back().start + chain.back().count == cluster)
+                    chain.back().count++;
+                else
+                    chain.push_back({cluster, 1});
+
+                if (is_last_cluster(FAT[cluster]))
+                    break;
+                cluster = FAT[cluster];
+            }
+        });
+
+        if (json) {
+            output() << "{\"name\":\"" << json_escape(name) << "\""
+                     << ",\"fat_type\":\"FAT" << fat_bits << "\""
+                     << ",\"block_size\":" << block_size_byte
+                     << ",\"block_count\":" << block_cnt
+                     << ",\"free_blocks\":" << free_cnt
+                     << ",\"used_blocks\":" << used_cnt
+                     << ",\"bad_blocks\":" << bad_cnt
+                     << ",\"unowned_blocks\":" << (used_cnt - owned_cnt)
+                     << ",\"files\":" << file_cnt
+                     << ",\"directories\":" << dir_cnt
+                     << ",\"fat1_start\":" << fat1_start
+                     << ",\"fat2_start\":" << fat2_start
+                     << ",\"root_dir_start\":" << root_dir_start
+                     << ",\"data_area_start\":" << data_area_start
+                     << ",\"entries\":[";
+            for (size_t k = 0; k < entries.size(); ++k) {
+                output() << (k ? "," : "") << "{\"path\":\"" << json_escape(paths[k]) << "\""
+                         << ",\"type\":\"" << (is_directory(*entries[k]) ? "dir" : "file") << "\""
+                         << ",\"size\":" << entries[k]->file_size
+                         << ",\"clusters\":[";
+                for (size_t r = 0; r < runs[k].size(); ++r)
+                    output() << (r ? "," : "") << "[" << runs[k][r].start << "," << runs[k][r].count << "]";
+                output() << "]}";
+            }
+            output() << "]}\n";
+            return;
+        }
+
         // Print file system information
-        std::cout << *boot_sector << std::endl;
-        std::cout << "Block size:" << block_size_byte << " bytes" << std::endl;
-        std::cout << "FAT1 Start: " << fat1_start << std::endl;
-        std::cout << "FAT2 Start: " << fat2_start << std::endl;
-        std::cout << "Root Directory Start: " << root_dir_start << std::endl;
-        std::cout << "Data Area Start: " << data_area_start << std::endl;
-        // TODO
-        // list block count, free blocks,
-        // number of files and directories.
-        // list all the occupied blocks and the file names for each of them.
-    }
-
-    void fat12_fs::write_file(DirectoryEntry* file, string& content) {
-        auto content_char = reinterpret_cast<char*>(&content);
-        
-        // write content
-        char* char_ptr = reinterpret_cast<char*>(&data_area[file->starting_cluster]);
-        strcpy(char_ptr, content.c_str()); 
-        file->file_size = content.size();
+        output() << *boot_sector << '\n';
+        output() << "FAT type: FAT" << fat_bits << '\n';
+        output() << "Block size:" << block_size_byte << " bytes" << '\n';
+        output() << "FAT1 Start: " << fat1_start << '\n';
+        output() << "FAT2 Start: " << fat2_start << '\n';
+        output() << "Root Directory Start: " << root_dir_start << '\n';
+        output() << "Data Area Start: " << data_area_start << '\n';
+        output() << "Block count: " << block_cnt << '\n';
+        output() << "Free blocks: " << free_cnt << '\n';
+        output() << "Used blocks: " << used_cnt << '\n';
+        if (bad_cnt > 0)
+            output() << "Bad blocks: " << bad_cnt << '\n';
+        if (used_cnt != owned_cnt)
+            output() << "Unowned blocks: " << (used_cnt - owned_cnt) << '\n';
+        output() << "Files: " << file_cnt << '\n';
+        output() << "Directories: " << dir_cnt << '\n';
+
+        output() << "Occupied blocks:" << '\n';
+        for (size_t k = 0; k < entries.size(); ++k) {
+            output() << "  " << paths[k] << (is_directory(*entries[k]) ? "/" : "") << ":";
+            for (auto& run : runs[k]) {
+                output() << ' ' << run.start;
+                if (run.count > 1)
+                    output() << '-' << (run.start + run.count - 1);
+            }
+            output() << '\n';
+        }
+    }
+
+    // Stream src_fd into a freshly allocated chain. The chain is sized from
+    // the file length up front and preferably contiguous, data is read
+    // straight into the image one run of clusters at a time. The entry is
+    // only pointed at the chain once it is filled, on failure the chain is
+    // freed and the entry left as it was.
+    void fat12_fs::write_file(DirectoryEntry* file, int src_fd, uint32_t size) {
+        int cnt = (size + block_size_byte - 1) / block_size_byte;
+        if (cnt == 0)
+            cnt = 1; // every file owns at least one cluster
+
+        uint16_t start = reserve_chain(cnt);
+        uint32_t copied = 0;
+        try {
+            for (auto& run : file_extents(start).extents()) {
+                char* dst = reinterpret_cast<char*>(cluster_ptr(run.start));
+                size_t run_bytes = static_cast<size_t>(run.count) * block_size_byte;
+                size_t want = size - copied < run_bytes ? size - copied : run_bytes;
+
+                size_t done = read_linux_run(src_fd, dst, want, run_bytes);
+                mark_dirty(dst, run_bytes);
+                copied += done;
+            }
+        } catch (...) {
+            free_chain(start);
+            throw;
+        }
+
+        file->starting_cluster = start;
+        file->file_size = copied;
+        stats.add(STAT_BYTES_IN, copied);
+        set_time_date(&(file->last_modification));
+        mark_dirty(file, sizeof(DirectoryEntry));
+        FAT12_INFO("Wrote " << copied << " bytes in " << cnt << " clusters starting at "
+                  << file->starting_cluster);
     }
     
+    // Copy file_size bytes of the file's chain to dst_fd. Each run of
+    // physically consecutive clusters is a single iovec (or a single
+    // copy_file_range() when the image is mapped from a file), so no
+    // intermediate copy of the content is made.
+    void fat12_fs::read_file(DirectoryEntry* file, int dst_fd) {
+        uint32_t remaining = file->file_size;
+        if (remaining == 0)
+            return;
+
+        auto& runs = file_extents(file->starting_cluster).extents();
+
+        uint32_t sent = 0; // bytes already at dst_fd
+        if (mapped_size != 0) {
+            // MAP_SHARED pages are the image's page cache, so the kernel can
+            // copy straight from the image file. Destinations it can't copy
+            // to (pipes, sockets, ttys) continue with writev from where it
+            // stopped, so dst_fd never has to be rewound.
+            bool unsupported = false;
+            for (auto& run : runs) {
+                if (sent == remaining || unsupported)
+                    break;
+                size_t run_bytes = static_cast<size_t>(run.count) * block_size_byte;
+                size_t len = remaining - sent < run_bytes ? remaining - sent : run_bytes;
+                loff_t src_off = buffer_offset(cluster_ptr(run.start));
+                while (len > 0) {
+                    ssize_t n = copy_file_range(image_fd, &src_off, dst_fd, nullptr, len, 0);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n == 0 || (n < 0 && (errno == EINVAL || errno == EXDEV || errno == EOPNOTSUPP
+                                             || errno == ENOSYS || errno == EBADF))) {
+                        unsupported = true;
+                        break;
+                    }
+                    if (n < 0) {
+                        throw std::runtime_error(string("Error writing output file: ") + std::strerror(errno));
+                    }
+                    len -= n;
+                    sent += n;
+                }
+            }
+            if (!unsupported && sent != remaining) {
+                throw std::runtime_error("Cluster chain is shorter than file size");
+            }
+            if (sent == remaining) {
+                stats.add(STAT_BYTES_OUT, file->file_size);
+                return;
+            }
+        }
+
+        std::vector<struct iovec> iov;
+        uint32_t skip = sent;
+        for (auto& run : runs) {
+            if (remaining == 0)
+                break;
+            size_t run_bytes = static_cast<size_t>(run.count) * block_size_byte;
+            size_t len = remaining < run_bytes ? remaining : run_bytes;
+            remaining -= len;
+            if (skip >= len) {
+                skip -= len;
+                continue;
+            }
+            iov.push_back({cluster_ptr(run.start) + skip, len - skip});
+            skip = 0;
+        }
+        if (remaining != 0) {
+            throw std::runtime_error("Cluster chain is shorter than file size");
+        }
+
+        size_t idx = 0;
+        while (idx < iov.size()) {
+            int batch = iov.size() - idx < IOV_MAX ? iov.size() - idx : IOV_MAX;
+            ssize_t n = writev(dst_fd, &iov[idx], batch);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error(string("Error writing output file: ") + std::strerror(errno));
+            }
+            // skip fully written vectors, trim a partially written one
+            while (n > 0 && static_cast<size_t>(n) >= iov[idx].iov_len) {
+                n -= iov[idx].iov_len;
+                ++idx;
+            }
+            if (n > 0) {
+                iov[idx].iov_base = static_cast<char*>(iov[idx].iov_base) + n;
+                iov[idx].iov_len -= n;
+            }
+        }
+        stats.add(STAT_BYTES_OUT, file->file_size);
+    }
 
     //
 
@@ -596,194 +1124,337 @@ namespace fat12 {
             : entry_cnt_in_block;
     }
 
+    // Resolve a tokenized absolute path to a directory entry, empty tokens
+    // resolve to the root directory. Resolved prefixes are cached. Each
+    // directory on the way is locked only while it is searched, so the
+    // caller must not hold a directory lock.
     DirectoryEntry* fat12_fs::find_dir_recursive(std::vector<std::string> tokens) {
-        DirectoryEntry* target_dir = root;
-        string dir_name;
-        bool found = false;
+        DirectoryEntry* target_dir = &root_dir;
+        string path;
+        size_t offset;
 
         for (auto& token : tokens) {
-            dir_name = token;
-            
-            target_dir = find_dir(target_dir, token);
-            if (target_dir == nullptr) {
-                std::cout << "break search!"<< std::endl;
-                std::cout << target_dir << std::endl;
-                break;
+            if (token.empty())
+                continue;
+            path += "/" + token;
+
+            if (dentries.find_path(path, offset)) {
+                auto cached = reinterpret_cast<DirectoryEntry*>(&fs_buffer[offset]);
+                if (is_directory(*cached) && entry_name_equals(*cached, token)) {
+                    target_dir = cached;
+                    continue;
+                }
             }
-            else
-                found = true;         
-        }
 
-        if (found == true && target_dir != nullptr) {
-            std::cout << "Reached target directory:," << dir_name << std::endl;
-            std::cout << *target_dir << std::endl;
+            {
+                StripeGuard guard(dir_locks, dir_cluster(target_dir), false);
+                target_dir = find_dir(target_dir, token);
+            }
+            if (target_dir == nullptr) {
+                FAT12_DEBUG("Can't resolve path: " << path);
+                return nullptr;
+            }
+            dentries.add_path(path, buffer_offset(target_dir));
         }
 
         return target_dir;
     }
 
     DirectoryEntry* fat12_fs::find_dir(DirectoryEntry* current, string& dir_name) {
-        int entry_cnt = is_in_root(current) ? boot_sector->BPB_RootEntCnt
-                                            : entry_cnt_in_block;
-        std::cout << "Searching " << dir_name << " under folder: " << current->filename << std::endl;
-        std::cout << *current << std::endl;
-
-/*         auto it = iterator(current);
-        while (it->has_next()) {
-            auto next = it->next();
-            if (!is_entry_free(*next)) {
-                if (is_directory(*next)) {
-                    if (next->filename == dir_name) {
-                        return next;
-                    }
-                }
-            }
-        } */
-        
-        for (int i = 0; i < entry_cnt; ++i) {
-            if (!is_entry_free(current[i])) {
-                if (is_directory(current[i])) {
-                    if (current[i].filename == dir_name) {
-                        return &current[i];
-                    }
-                }
-            }
-        }
+        auto entry = find_entry(current, dir_name);
+        if (entry != nullptr && is_directory(*entry))
+            return entry;
 
-        std::cout << "Can't find given directory: " << dir_name << std::endl;
+        FAT12_DEBUG("Can't find given directory: " << dir_name);
         return nullptr;
     }
 
+    // Look up a file or directory directly under dir, whose lock the caller holds
+    DirectoryEntry* fat12_fs::find_entry(DirectoryEntry* dir, const string& name) {
+        uint16_t parent_cluster = dir_cluster(dir);
+        size_t offset;
+
+        if (dentries.find_child(parent_cluster, name, offset)) {
+            auto cached = reinterpret_cast<DirectoryEntry*>(&fs_buffer[offset]);
+            if (!is_entry_free(*cached) && entry_name_equals(*cached, name))
+                return cached;
+            dentries.forget(parent_cluster, name);
+        }
+
+        DirectoryEntry* entry = nullptr;
+        DirIndex* index = get_dir_index(dir);
+        if (index != nullptr) {
+            // the index is authoritative, a miss means there is no such child
+            if (index->find(name, offset))
+                entry = reinterpret_cast<DirectoryEntry*>(&fs_buffer[offset]);
+        }
+        else {
+            if (name.empty() || name.size() > ENTRY_NAME_LEN)
+                return nullptr;
+            char key[ENTRY_NAME_LEN];
+            make_name_key(name, key);
+            entry = scan_slots(dir, [&key](const DirectoryEntry* slots, int cnt) {
+                return find_name_slot(slots, cnt, key);
+            });
+        }
+
+        if (entry != nullptr)
+            dentries.add_child(parent_cluster, name, buffer_offset(entry));
+        return entry;
+    }
+
+    // Find a free slot under current, growing a subdirectory by one
+    // cluster when it is full
     DirectoryEntry* fat12_fs::find_empty_dir(DirectoryEntry* current) {
-        int entry_cnt = is_in_root(current) ? boot_sector->BPB_RootEntCnt
-            : entry_cnt_in_block;
+        DirectoryEntry* empty = nullptr;
+        DirIndex* index = get_dir_index(current);
+        size_t offset;
 
-        if (is_in_root(current)) {
-            std::cout << current->filename << " is inside root directory" << std::endl;
-        }
-        for (int i = 0; i < entry_cnt; ++i) {
-            if (is_directory(current[i])) {
-                std::cout << "Check directory: " << current[i].filename << std::endl;
-                auto fat_idx = current[i].starting_cluster;
-                auto cluster_num = fat_idx;
-                check_fat_idx(fat_idx);
-
-                FatEntry fat_entry;
-                do {
-                    auto cluster_start = cluster_num * block_size_byte;
-                    auto cluster = reinterpret_cast<DirectoryEntry*>(&data_area[cluster_start]);
-
-                    std::cout << "Searching for cluster_num: " << cluster_num << std::endl;
-                    std::cout << "              cluster_start: " << cluster_start << std::endl;
-                    for (int i = 0; i < entry_cnt_in_block; ++i) {
-                        if (is_entry_free(cluster[i])) {
-                            std::cout << "Found empty directory at index " << i << std::endl;
-                            return &cluster[i];
-                        }
-                            
-                    }
+        if (index != nullptr) {
+            if (index->first_free(offset))
+                empty = reinterpret_cast<DirectoryEntry*>(&fs_buffer[offset]);
+        }
+        else {
+            empty = scan_slots(current, [](const DirectoryEntry* slots, int cnt) {
+                return find_free_slot(slots, cnt);
+            });
+        }
 
-                    fat_entry = FAT[fat_idx];
-                    cluster_num = fat_entry;
-                } while (!is_last_cluster(fat_entry));
-                std::cout << "End search empty cluster" << std::endl;
-            }
+        if (empty == nullptr && !is_root_dir(current))
+            empty = extend_dir(current);
+
+        if (empty == nullptr)
+            FAT12_DEBUG("There's no free directories under: " << current->filename);
+        return empty;
+    }
+
+    // Append a zeroed cluster to a subdirectory, returns its first slot
+    DirectoryEntry* fat12_fs::extend_dir(DirectoryEntry* dir) {
+        auto runs = get_chain_runs(dir->starting_cluster);
+        uint16_t last = runs.back().start + runs.back().count - 1;
+
+        uint16_t new_cluster = reserve_cluster();
+        set_fat(last, new_cluster);
+        std::memset(cluster_ptr(new_cluster), 0, block_size_byte);
+        mark_dirty(cluster_ptr(new_cluster), block_size_byte);
+
+        auto slots = reinterpret_cast<DirectoryEntry*>(cluster_ptr(new_cluster));
+        DirIndex* index = cached_dir_index(dir->starting_cluster);
+        if (index != nullptr) {
+            for (int i = 0; i < entry_cnt_in_block; ++i)
+                index->add_free(buffer_offset(&slots[i]));
         }
-        
-        std::cout << "There's no free directories under: " << current->filename << std::endl;
-        return nullptr;
+        FAT12_INFO("Extended directory " << dir->filename << " with cluster " << new_cluster);
+        return &slots[0];
+    }
+
+    // Lazily build the name index of a directory, nullptr when disabled
+    DirIndex* fat12_fs::get_dir_index(DirectoryEntry* dir) {
+        if (!dir_index_enabled)
+            return nullptr;
+
+        uint16_t cluster = dir_cluster(dir);
+        DirIndex* cached = cached_dir_index(cluster);
+        if (cached != nullptr)
+            return cached;
+
+        // built unlocked; when readers race on the same directory the
+        // first index inserted wins, the others are identical anyway
+        DirIndex index;
+        scan_dir(dir, [this, &index](const DirectoryEntry& e) {
+            if (is_entry_free(e))
+                index.add_free(buffer_offset(&e));
+            else
+                index.add(entry_name(e), buffer_offset(&e));
+            return false;
+        });
+        std::lock_guard<std::mutex> guard(cache_lock);
+        return &dir_indexes.emplace(cluster, std::move(index)).first->second;
+    }
+
+    // The index of the directory at cluster if one was built, else nullptr
+    DirIndex* fat12_fs::cached_dir_index(uint16_t cluster) {
+        std::lock_guard<std::mutex> guard(cache_lock);
+        auto it = dir_indexes.find(cluster);
+        return it == dir_indexes.end() ? nullptr : &it->second;
+    }
+
+    void fat12_fs::set_dir_index(bool enabled) {
+        RwGuard guard(fs_lock, true);
+        dir_index_enabled = enabled;
+        dir_indexes.clear();
+    }
+
+    // A free slot of parent now holds name
+    void fat12_fs::claim_slot(DirectoryEntry* parent, DirectoryEntry* slot, const string& name) {
+        uint16_t cluster = dir_cluster(parent);
+        dentries.add_child(cluster, name, buffer_offset(slot));
+        DirIndex* index = cached_dir_index(cluster);
+        if (index != nullptr)
+            index->take(buffer_offset(slot), name);
+    }
+
+    // Mark the slot holding name deleted and forget it
+    void fat12_fs::release_slot(DirectoryEntry* parent, DirectoryEntry* slot, const string& name) {
+        uint16_t cluster = dir_cluster(parent);
+        slot->filename[0] = DIR_NAME_FREE[0];
+        mark_dirty(slot, sizeof(DirectoryEntry));
+        dentries.forget(cluster, name);
+        DirIndex* index = cached_dir_index(cluster);
+        if (index != nullptr)
+            index->release(name);
+    }
+
+    DirRange fat12_fs::entries(DirectoryEntry* dir) {
+        DirLayout layout = { nullptr, 0, FAT.data(), data_area, block_size_byte,
+                             entry_cnt_in_block, cluster_cnt, &stats };
+        if (is_root_dir(dir)) {
+            layout.root = root;
+            layout.root_cnt = boot_sector->BPB_RootEntCnt;
+        }
+        return DirRange(layout, dir_cluster(dir));
+    }
+
+    size_t fat12_fs::buffer_offset(const void* ptr) {
+        return static_cast<const char*>(ptr) - fs_buffer;
+    }
+
+    bool fat12_fs::is_root_dir(const DirectoryEntry* dir) {
+        return dir == &root_dir || (is_directory(*dir) && dir->starting_cluster == 0);
+    }
+
+    uint16_t fat12_fs::dir_cluster(const DirectoryEntry* dir) {
+        return is_root_dir(dir) ? 0 : dir->starting_cluster;
+    }
+
+    // Cluster of the directory holding dir's own entry, from its ".."
+    // slot. The root has no such entry, it is its own parent here.
+    uint16_t fat12_fs::parent_cluster(const DirectoryEntry* dir) {
+        if (is_root_dir(dir))
+            return 0;
+        return reinterpret_cast<const DirectoryEntry*>(cluster_ptr(dir->starting_cluster))[1].starting_cluster;
     }
 
 
     // TODO
     // Traverse through whole file system
     void fat12_fs::traverse_all() {
-        std::cout << "traverse_all!!!!" << std::endl;
+        FAT12_DEBUG("traverse_all");
         this->root = reinterpret_cast<DirectoryEntry*>(&fs_buffer[root_dir_start]);
         for (int i = 0; i < boot_sector->BPB_RootEntCnt; ++i) {
             if (!is_entry_free(root[i])) {
-                std::cout << i << "th Directory under root:\n" << root[i] << std::endl;
+                FAT12_DEBUG(i << "th Directory under root:\n" << root[i]);
                 traverse(&root[i]);
             }
         }
     }
 
 
+    // Visit every entry below dir with its full path, depth first. "." and ".."
+    // are skipped and each directory cluster is entered once. A directory
+    // whose chain is corrupted throws, unless unreadable is given: it is
+    // then told about it and the entries read so far are still visited.
+    // Errors thrown by visit always propagate.
+    void fat12_fs::walk_tree(DirectoryEntry* dir, const string& path,
+                             const std::function<void(DirectoryEntry&, const string&)>& visit,
+                             const std::function<void(const string&, const std::runtime_error&)>& unreadable) {
+        std::vector<std::pair<DirectoryEntry*, string>> pending;
+        std::unordered_set<uint16_t> seen;
+        pending.push_back(std::make_pair(dir, path));
+        seen.insert(dir_cluster(dir));
+
+        while (!pending.empty()) {
+            DirectoryEntry* current = pending.back().first;
+            string current_path = pending.back().second;
+            pending.pop_back();
+
+            std::vector<std::pair<DirectoryEntry*, string>> children;
+            try {
+                for (auto& child : entries(current)) {
+                    if (child.filename[0] != '.')
+                        children.push_back(std::make_pair(&child, current_path + "/" + entry_name(child)));
+                }
+            } catch (const std::runtime_error& e) {
+                if (!unreadable)
+                    throw;
+                unreadable(current_path.empty() ? "/" : current_path, e);
+            }
+
+            for (auto& child : children) {
+                visit(*child.first, child.second);
+                if (is_directory(*child.first) && seen.insert(child.first->starting_cluster).second)
+                    pending.push_back(child);
+            }
+        }
+    }
+
     void fat12_fs::traverse(DirectoryEntry* entry) {
 
         if (!is_directory(*entry))
             return;
 
-        std::cout << "Check directory: " << entry->filename << std::endl;
-        auto fat_idx = entry->starting_cluster;
-        auto cluster_num = fat_idx;
-        check_fat_idx(fat_idx);
-
-        FatEntry fat_entry;
-        do {
-            auto cluster_start = cluster_num * block_size_byte;
-            auto cluster = reinterpret_cast<DirectoryEntry*>(&data_area[cluster_start]);
-
-/*             std::cout << "Searching for cluster_num: " << cluster_num << std::endl;
-            std::cout << "              cluster_start: " << cluster_start << std::endl;
-            std::cout << "              fat_idx: " << fat_idx << std::endl; */
-            for (int i = 0; i < entry_cnt_in_block; ++i) {
-                if (!is_entry_free(cluster[i])) {
-                    std::cout << "Found directory:\n" << cluster[i] << std::endl;
-                    if (i >= 2 && !is_in_root(&cluster[i])) {
-                        traverse(&cluster[i]);
-                    }
-                }
-            }
+        FAT12_DEBUG("Check directory: " << entry->filename);
+        check_fat_idx(entry->starting_cluster);
 
-            fat_entry = FAT[fat_idx];
-            cluster_num = fat_entry;
-        } while (!is_last_cluster(fat_entry));
+        for (auto& child : entries(entry)) {
+            FAT12_DEBUG("Found directory:\n" << child);
+            if (child.filename[0] != '.') // skip "." and ".."
+                traverse(&child);
+        }
     }
 
 
     void fat12_fs::create_file(DirectoryEntry* empty, DirectoryEntry* parent, string file_name) {
-        std::cout << "Attemp to create a file: " << file_name
-                  << ", Under parent directory: " << parent->filename << std::endl;
+        FAT12_DEBUG("Attemp to create a file: " << file_name
+                  << ", Under parent directory: " << parent->filename);
 
-        
-        uint16_t new_cluster = reserve_cluster();
-        std::cout << "Reserved a new cluster: " << new_cluster << std::endl;
-        std::strncpy(empty->filename, file_name.c_str(), file_name.size());
+        // clusters are reserved by write_file() once the size is known
+        check_entry_name(file_name);
+        set_entry_name(empty, file_name);
+        empty->attributes = 0;
         empty->file_size = 0;
-        empty->starting_cluster = new_cluster;
+        empty->starting_cluster = 0;
         set_time_date(&(empty->creation));
         set_time_date(&(empty->last_modification));
         set_time_date(&(parent->last_modification));
-        std::cout << "Created a file: " << file_name << "\n" << empty << std::endl;
+        mark_dirty(empty, sizeof(DirectoryEntry));
+        mark_dirty(parent, sizeof(DirectoryEntry));
+        claim_slot(parent, empty, file_name);
+        FAT12_TRACE("Created a file: " << file_name << "\n" << empty);
     }
 
     void fat12_fs::create_dir(DirectoryEntry* empty, DirectoryEntry* parent, string& dir_name) {
-        std::cout << "Attemp to create a directory: " << dir_name
-            << ", Under parent directory: " << parent->filename << std::endl;
+        FAT12_DEBUG("Attemp to create a directory: " << dir_name
+            << ", Under parent directory: " << parent->filename);
 
+        check_entry_name(dir_name);
         uint16_t new_cluster = reserve_cluster();
-        std::cout << "Reserved a new cluster: " << new_cluster << std::endl;
+        FAT12_DEBUG("Reserved a new cluster: " << new_cluster);
 
-        std::strncpy(empty->filename, dir_name.c_str(), dir_name.size());
+        set_entry_name(empty, dir_name);
         empty->attributes = ATTR_DIRECTORY;
         empty->file_size = 0;
         empty->starting_cluster = new_cluster;
         set_time_date(&(empty->creation));
         set_time_date(&(empty->last_modification));
         set_time_date(&(parent->last_modification)); // update paren'ts last modification timestamp
+        mark_dirty(empty, sizeof(DirectoryEntry));
+        mark_dirty(parent, sizeof(DirectoryEntry));
+        claim_slot(parent, empty, dir_name);
+        {
+            std::lock_guard<std::mutex> guard(cache_lock);
+            dir_indexes.erase(new_cluster); // stale index of a previous owner
+        }
         initialize_new_dir(new_cluster, empty, parent);
     }
 
     void fat12_fs::initialize_new_dir(uint16_t cluster_num, DirectoryEntry* current, DirectoryEntry* parent) {
-        std::cout << "initialize_new_dir at cluser: " << cluster_num << std::endl;
-        std::cout << "current entry: " << *current << std::endl;
-        std::cout << "parent entry: " << *parent << std::endl;
+        FAT12_DEBUG("initialize_new_dir at cluser: " << cluster_num);
+        FAT12_TRACE("current entry: " << *current);
+        FAT12_TRACE("parent entry: " << *parent);
 
         // Set all bytes in the cluster to zero
-        size_t cluster_start = cluster_num * block_size_byte;
-        std::cout << "cluster_start: " << cluster_start << std::endl;
-        std::memset(&data_area[cluster_start], 0, block_size_byte);
+        std::memset(cluster_ptr(cluster_num), 0, block_size_byte);
 
         // initialize a directory entry as "." as current directory
         DirectoryEntry dot_entry;
@@ -796,31 +1467,183 @@ namespace fat12 {
         //std::memcpy(&dotdot_entry, parent, sizeof(DirectoryEntry));
         dotdot_entry = *parent;
         std::strncpy(dotdot_entry.filename, "..         ", 11); // Name padded to 11 characters
-        if (parent == root)
+        if (is_root_dir(parent))
         {
             dotdot_entry.attributes = ATTR_DIRECTORY;
             dotdot_entry.starting_cluster = 0; // root
         }
 
         // write dot and dotdot as first 2 directories for the directory to be initialized
-        std::cout << "Dot entry: " << dot_entry << std::endl;
-        std::cout << "Dotdot entry: " << dotdot_entry << std::endl;
-        auto cluster = reinterpret_cast<DirectoryEntry*>(&data_area[cluster_start]);
+        FAT12_TRACE("Dot entry: " << dot_entry);
+        FAT12_TRACE("Dotdot entry: " << dotdot_entry);
+        auto cluster = reinterpret_cast<DirectoryEntry*>(cluster_ptr(cluster_num));
         cluster[0] = dot_entry;
         cluster[1] = dotdot_entry;
+        mark_dirty(cluster, block_size_byte);
     }
 
-    // Function to find a free cluster in the FAT
+    // Index free clusters once per mount, allocations never rescan the FAT
+    void fat12_fs::build_allocator() {
+        allocator.reset(FAT_RESERVED_CNT, cluster_cnt);
+        for (int i = FAT_RESERVED_CNT; i < cluster_cnt; ++i) {
+            if (FAT[i] != FAT_ENTRY_UNUSED)
+                allocator.mark_used(i);
+        }
+        FAT12_DEBUG("Free clusters: " << allocator.free_count() << "/" << cluster_cnt);
+    }
+
+    // Reserve a single free cluster and mark it as end of chain
     uint16_t fat12_fs::reserve_cluster() {
-        // Iterate through the FAT entries to find a free cluster
-        for (int i = FAT_RESERVED_CNT; i < fat_size_bytes / sizeof(FatEntry); ++i) {
-            if (FAT[i] == FAT_ENTRY_UNUSED)
-            {
-                FAT[i] = EOC_MARKER;
-                return i;
+        int cluster = allocator.allocate();
+        if (cluster < 0) {
+            throw std::runtime_error("No free clusters left on " + name);
+        }
+        set_fat(cluster, EOC_MARKER);
+        stats.add(STAT_CLUSTERS_ALLOCATED);
+        return cluster;
+    }
+
+    // Reserve cnt consecutive clusters, returns the first one or -1
+    int fat12_fs::reserve_contiguous(int cnt) {
+        int start = allocator.allocate_contiguous(cnt);
+        if (start < 0)
+            return -1;
+
+        for (int i = 0; i < cnt - 1; ++i)
+            set_fat(start + i, start + i + 1);
+        set_fat(start + cnt - 1, EOC_MARKER);
+        stats.add(STAT_CLUSTERS_ALLOCATED, cnt);
+        return start;
+    }
+
+    // Reserve and link a chain of cnt clusters, contiguous when possible
+    uint16_t fat12_fs::reserve_chain(int cnt) {
+        if (static_cast<uint32_t>(cnt) > allocator.free_count()) {
+            throw std::runtime_error("Not enough free clusters on " + name);
+        }
+
+        int start = reserve_contiguous(cnt);
+        if (start >= 0)
+            return start;
+
+        // fragmented volume, fall back to linking single clusters
+        uint16_t first = reserve_cluster();
+        uint16_t prev = first;
+        try {
+            for (int i = 1; i < cnt; ++i) {
+                uint16_t next = reserve_cluster();
+                set_fat(prev, next);
+                prev = next;
+            }
+        } catch (...) {
+            // other writers took the clusters counted above
+            free_chain(first);
+            throw;
+        }
+        return first;
+    }
+
+    void fat12_fs::free_chain(uint16_t start) {
+        uint16_t cluster = start;
+        int hops = 0;
+        while (cluster >= FAT_RESERVED_CNT && cluster < cluster_cnt && hops++ < cluster_cnt) {
+            FatEntry next = FAT[cluster];
+            set_fat(cluster, FAT_ENTRY_UNUSED);
+            if (is_last_cluster(next))
+                break;
+            cluster = next;
+        }
+        stats.add(STAT_FAT_LOOKUPS, hops);
+        stats.add(STAT_CLUSTERS_FREED, hops);
+        std::lock_guard<std::mutex> guard(cache_lock);
+        extent_maps.erase(start);
+    }
+
+    // Cached extent map of the chain at start, built on first use
+    ExtentMap& fat12_fs::file_extents(uint16_t start) {
+        {
+            std::lock_guard<std::mutex> guard(cache_lock);
+            auto it = extent_maps.find(start);
+            if (it != extent_maps.end())
+                return it->second;
+        }
+
+        ExtentMap map;
+        stats.add(STAT_FAT_LOOKUPS, map.build(FAT.data(), cluster_cnt, start));
+        std::lock_guard<std::mutex> guard(cache_lock);
+        return extent_maps.emplace(start, std::move(map)).first->second;
+    }
+
+    // Split a cluster chain into runs of physically consecutive clusters
+    std::vector<ClusterRun> fat12_fs::get_chain_runs(uint16_t start) {
+        std::vector<ClusterRun> runs;
+        uint16_t cluster = start;
+        int hops = 0;
+
+        while (true) {
+            if (cluster < FAT_RESERVED_CNT || cluster >= cluster_cnt || hops++ >= cluster_cnt) {
+                throw std::runtime_error("Corrupted cluster chain at cluster " + std::to_string(cluster));
             }
+
+            if (!runs.empty() && runs.back().start + runs.back().count == cluster)
+                runs.back().count++;
+            else
+                runs.push_back({cluster, 1});
+
+            FatEntry next = FAT[cluster];
+            if (is_last_cluster(next))
+                break;
+            cluster = next;
         }
-        return -1;
+        stats.add(STAT_FAT_LOOKUPS, hops);
+        return runs;
+    }
+
+    // The data area starts with cluster 2, entries 0 and 1 are reserved
+    uint8_t* fat12_fs::cluster_ptr(uint16_t cluster) {
+        return &data_area[static_cast<size_t>(cluster - FAT_RESERVED_CNT) * block_size_byte];
+    }
+
+    // Update a FAT entry in the shadow table, flush_fat() packs it into both copies
+    void fat12_fs::set_fat(uint16_t idx, FatEntry value) {
+        FAT[idx] = value;
+        {
+            std::lock_guard<std::mutex> guard(dirty_lock);
+            fat_dirty.add(idx, 1);
+        }
+        if (value == FAT_ENTRY_UNUSED)
+            allocator.mark_free(idx);
+        else
+            allocator.mark_used(idx);
+    }
+
+    // Re-encode changed shadow entries into FAT1 and FAT2, one pass per merged range
+    void fat12_fs::flush_fat() {
+        uint8_t* fat1 = reinterpret_cast<uint8_t*>(&fs_buffer[fat1_start]);
+        uint8_t* fat2 = reinterpret_cast<uint8_t*>(&fs_buffer[fat2_start]);
+        for (auto& range : fat_dirty) {
+            encode_fat(fat_bits, FAT.data(), fat1, range.first, range.second);
+            encode_fat(fat_bits, FAT.data(), fat2, range.first, range.second);
+
+            size_t start = fat_table_offset(fat_bits, range.first);
+            size_t len = fat_table_size(fat_bits, range.second) - start;
+            mark_dirty(fat1 + start, len);
+            mark_dirty(fat2 + start, len);
+        }
+        fat_dirty.clear();
+    }
+
+    // Record a modified region of fs_buffer, pointers outside the image are ignored
+    void fat12_fs::mark_dirty(const void* ptr, size_t len) {
+        const char* p = static_cast<const char*>(ptr);
+        if (p < fs_buffer || p >= fs_buffer + total_size_bytes)
+            return;
+
+        size_t offset = p - fs_buffer;
+        if (offset + len > static_cast<size_t>(total_size_bytes))
+            len = total_size_bytes - offset;
+        std::lock_guard<std::mutex> guard(dirty_lock);
+        dirty.add(offset, len);
     }
 
 } // namespace
\ No newline at end of file
@@ -0,0 +1,210 @@
+#include "fat12_allocator.hpp"
+
+namespace fat12 {
+
+    namespace {
+
+        // Threads get consecutive numbers on their first allocation, a
+        // prime stride spreads their home groups over the volume. The
+        // group a thread last allocated from is where it starts next.
+        const uint32_t GROUP_STRIDE = 37;
+        const uint32_t NO_GROUP = UINT32_MAX;
+        std::atomic<uint32_t> thread_seq(0);
+        thread_local uint32_t thread_group = NO_GROUP;
+
+    }//namespace
+
+    void ClusterAllocator::reset(uint32_t first_cluster, uint32_t cluster_limit) {
+        first = first_cluster;
+        limit = cluster_limit < first_cluster ? first_cluster : cluster_limit;
+        free_cnt = limit - first;
+
+        bits.assign((limit + 63) / 64, 0);
+        // clusters below first are never handed out
+        for (uint32_t c = 0; c < first; ++c)
+            bits[c / 64] |= (1ULL << (c % 64));
+
+        group_cnt = (limit + GROUP_CLUSTERS - 1) / GROUP_CLUSTERS;
+        groups.reset(new Group[group_cnt]);
+        for (uint32_t i = 0; i < group_cnt; ++i) {
+            Group& group = groups[i];
+            group.start = i * GROUP_CLUSTERS < first ? first : i * GROUP_CLUSTERS;
+            group.end = (i + 1) * GROUP_CLUSTERS < limit ? (i + 1) * GROUP_CLUSTERS : limit;
+            group.cursor = group.start;
+            group.free_cnt = group.end > group.start ? group.end - group.start : 0;
+        }
+    }
+
+    uint32_t ClusterAllocator::home_group() const {
+        if (thread_group == NO_GROUP)
+            thread_group = thread_seq.fetch_add(1) * GROUP_STRIDE;
+        return thread_group % group_cnt;
+    }
+
+    void ClusterAllocator::take(Group& group, uint32_t cluster) {
+        uint64_t mask = 1ULL << (cluster % 64);
+        if (!(bits[cluster / 64] & mask)) {
+            bits[cluster / 64] |= mask;
+            --group.free_cnt;
+            free_cnt.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    void ClusterAllocator::give_back(Group& group, uint32_t cluster) {
+        uint64_t mask = 1ULL << (cluster % 64);
+        if (bits[cluster / 64] & mask) {
+            bits[cluster / 64] &= ~mask;
+            ++group.free_cnt;
+            free_cnt.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void ClusterAllocator::mark_used(uint32_t cluster) {
+        if (cluster < first || cluster >= limit)
+            return;
+        Group& group = group_of(cluster);
+        std::lock_guard<std::mutex> guard(group.lock);
+        take(group, cluster);
+    }
+
+    void ClusterAllocator::mark_free(uint32_t cluster) {
+        if (cluster < first || cluster >= limit)
+            return;
+        Group& group = group_of(cluster);
+        std::lock_guard<std::mutex> guard(group.lock);
+        give_back(group, cluster);
+    }
+
+    bool ClusterAllocator::is_free(uint32_t cluster) {
+        if (cluster < first || cluster >= limit)
+            return false;
+        Group& group = group_of(cluster);
+        std::lock_guard<std::mutex> guard(group.lock);
+        return !(bits[cluster / 64] & (1ULL << (cluster % 64)));
+    }
+
+    // First free cluster in [from, to), or `to` if there is none
+    uint32_t ClusterAllocator::find_free(uint32_t from, uint32_t to) const {
+        uint32_t c = from;
+        while (c < to) {
+            uint64_t word = ~bits[c / 64] >> (c % 64);
+            if (word == 0) {
+                c = (c / 64 + 1) * 64; // whole remainder of the word is used
+                continue;
+            }
+            c += __builtin_ctzll(word);
+            return c < to ? c : to;
+        }
+        return to;
+    }
+
+    // Number of free clusters starting at `from` and below `to`, counting at most `max`
+    uint32_t ClusterAllocator::run_length(uint32_t from, uint32_t to, uint32_t max) const {
+        uint32_t c = from;
+        uint32_t end = (to - from < max) ? to : from + max;
+        while (c < end) {
+            uint64_t word = bits[c / 64] >> (c % 64);
+            if (word == 0) {
+                c = (c / 64 + 1) * 64;
+                continue;
+            }
+            c += __builtin_ctzll(word);
+            break;
+        }
+        return (c < end ? c : end) - from;
+    }
+
+    // Start of the first run of n free clusters inside [from, to), or `to`
+    uint32_t ClusterAllocator::find_run(uint32_t from, uint32_t to, uint32_t n) const {
+        uint32_t c = from;
+        while (c < to && to - c >= n) {
+            c = find_free(c, to);
+            if (c == to)
+                break;
+            uint32_t run = run_length(c, to, n);
+            if (run == n)
+                return c;
+            c += run; // lands on a used cluster, skip past the short run
+        }
+        return to;
+    }
+
+    int ClusterAllocator::allocate() {
+        if (free_count() == 0)
+            return -1;
+
+        uint32_t home = home_group();
+        for (uint32_t i = 0; i < group_cnt; ++i) {
+            uint32_t g = (home + i) % group_cnt;
+            Group& group = groups[g];
+            std::lock_guard<std::mutex> guard(group.lock);
+            if (group.free_cnt == 0)
+                continue;
+
+            uint32_t c = find_free(group.cursor, group.end);
+            if (c == group.end)
+                c = find_free(group.start, group.cursor); // wrap around
+            take(group, c);
+            group.cursor = c + 1 < group.end ? c + 1 : group.start;
+            thread_group = g;
+            return c;
+        }
+        return -1;
+    }
+
+    int ClusterAllocator::allocate_contiguous(uint32_t n) {
+        if (n == 0 || n > free_count())
+            return -1;
+        if (n == 1)
+            return allocate();
+
+        // Within one group: from its cursor to its end, then from its
+        // start. A run is not allowed to straddle the wrap point.
+        uint32_t home = home_group();
+        if (n <= GROUP_CLUSTERS) {
+            for (uint32_t i = 0; i < group_cnt; ++i) {
+                uint32_t g = (home + i) % group_cnt;
+                Group& group = groups[g];
+                std::lock_guard<std::mutex> guard(group.lock);
+                if (group.free_cnt < n)
+                    continue;
+
+                uint32_t c = find_run(group.cursor, group.end, n);
+                if (c == group.end) {
+                    uint32_t end = group.cursor + n - 1 < group.end ? group.cursor + n - 1 : group.end;
+                    c = find_run(group.start, end, n);
+                    if (c == end)
+                        continue;
+                }
+                for (uint32_t k = 0; k < n; ++k)
+                    take(group, c + k);
+                group.cursor = c + n < group.end ? c + n : group.start;
+                thread_group = g;
+                return c;
+            }
+        }
+
+        // Across groups, with all of them locked in order
+        std::vector<std::unique_lock<std::mutex>> held;
+        held.reserve(group_cnt);
+        for (uint32_t g = 0; g < group_cnt; ++g)
+            held.push_back(std::unique_lock<std::mutex>(groups[g].lock));
+
+        uint32_t from = groups[home].start;
+        uint32_t c = find_run(from, limit, n);
+        if (c == limit) {
+            uint32_t end = from + n - 1 < limit ? from + n - 1 : limit;
+            c = find_run(first, end, n);
+            if (c == end)
+                return -1;
+        }
+        for (uint32_t k = 0; k < n; ++k) {
+            Group& group = group_of(c + k);
+            take(group, c + k);
+            group.cursor = c + n < group.end ? c + n : group.start;
+        }
+        thread_group = (c + n - 1) / GROUP_CLUSTERS;
+        return c;
+    }
+
+}//namespace
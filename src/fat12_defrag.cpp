@@ -0,0 +1,239 @@
+#include "fat12.hpp"
+#include "fat12_log.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+namespace fat12 {
+
+    namespace {
+
+        // One file or directory with its chain in file order
+        struct Chain {
+            DirectoryEntry* entry;
+            string path;
+            std::vector<uint16_t> clusters;
+            uint32_t extents;
+            uint32_t gap;       // clusters skipped between consecutive extents
+        };
+
+        // Where a chain should go: target window and clusters to copy
+        struct Placement {
+            uint16_t target;
+            uint32_t moves;
+        };
+
+        void measure(Chain& chain) {
+            chain.extents = chain.clusters.empty() ? 0 : 1;
+            chain.gap = 0;
+            for (size_t i = 1; i < chain.clusters.size(); ++i) {
+                int step = chain.clusters[i] - chain.clusters[i - 1];
+                if (step != 1) {
+                    chain.extents++;
+                    chain.gap += step > 0 ? step - 1 : -step + 1;
+                }
+            }
+        }
+
+    }//namespace
+
+    /*
+        defrag [report|-n]
+        Report per-chain fragmentation (extents and the clusters skipped
+        between them) and, unless only a report is asked for, make every
+        fragmented chain contiguous. For each chain the windows that keep
+        one of its extents in place are tried, and the one with the most
+        clusters already in position wins, so only the rest are copied;
+        otherwise any free run long enough is used. Chains with no room
+        are left alone. Files go first, then directories deepest first, so
+        entry pointers collected up front stay valid: a directory's own
+        "." and its children's ".." follow it when it moves. A cross-linked
+        or corrupted chain anywhere fails the command before any move.
+    */
+    void fat12_fs::defrag(const string& param) {
+        bool report_only = (param == "report" || param == "-n");
+        if (!param.empty() && !report_only) {
+            throw std::invalid_argument("Usage: defrag [report|-n]");
+        }
+
+        // - Collect every chain, refusing cross-linked volumes. Errors pass
+        //   up through walk_tree, so nothing has moved when one is thrown.
+        std::vector<Chain> files, dirs;
+        std::vector<bool> owned(cluster_cnt, false);
+        walk_tree(&root_dir, "", [&](DirectoryEntry& entry, const string& path) {
+            if (entry.starting_cluster == 0)
+                return;
+            Chain chain;
+            chain.entry = &entry;
+            chain.path = path;
+            for (auto& run : get_chain_runs(entry.starting_cluster)) {
+                for (uint16_t c = run.start; c < run.start + run.count; ++c) {
+                    if (owned[c]) {
+                        throw std::runtime_error("Cluster " + std::to_string(c) + " is cross-linked, run fsck -r first");
+                    }
+                    owned[c] = true;
+                    chain.clusters.push_back(c);
+                }
+            }
+            measure(chain);
+            (is_directory(entry) ? dirs : files).push_back(chain);
+        });
+
+        // - Report
+        uint32_t fragmented = 0, extents = 0, clusters = 0;
+        for (auto* list : {&files, &dirs}) {
+            for (auto& chain : *list) {
+                extents += chain.extents;
+                clusters += chain.clusters.size();
+                if (chain.extents > 1) {
+                    ++fragmented;
+                    output() << "  " << chain.path << (is_directory(*chain.entry) ? "/" : "") << ": "
+                             << chain.extents << " extents, " << chain.clusters.size() << " clusters, gap "
+                             << chain.gap << '\n';
+                }
+            }
+        }
+        uint32_t free_runs = 0, largest_free = 0;
+        for (int c = FAT_RESERVED_CNT; c < cluster_cnt; ) {
+            if (!allocator.is_free(c)) {
+                ++c;
+                continue;
+            }
+            int start = c;
+            while (c < cluster_cnt && allocator.is_free(c))
+                ++c;
+            ++free_runs;
+            largest_free = std::max<uint32_t>(largest_free, c - start);
+        }
+        size_t chain_cnt = files.size() + dirs.size();
+        output() << "Chains: " << chain_cnt << " (" << fragmented << " fragmented), " << extents << " extents over "
+                 << clusters << " clusters" << '\n';
+        output() << "Free space: " << allocator.free_count() << " clusters in " << free_runs << " runs, largest "
+                 << largest_free << '\n';
+        if (report_only || fragmented == 0)
+            return;
+        if (!open_files.empty()) {
+            throw std::runtime_error("Close open files before defragmenting");
+        }
+
+        // - Place and move fragmented chains, biggest first within each pass
+        auto place = [&](const Chain& chain, Placement& best) -> bool {
+            uint32_t n = chain.clusters.size();
+            best.moves = n + 1;
+            for (size_t i = 0; i < chain.clusters.size(); ++i) {
+                // only the first cluster of each extent anchors a window
+                if (i > 0 && chain.clusters[i] == chain.clusters[i - 1] + 1)
+                    continue;
+                int target = chain.clusters[i] - static_cast<int>(i);
+                if (target < FAT_RESERVED_CNT || target + n > static_cast<uint32_t>(cluster_cnt))
+                    continue;
+
+                uint32_t in_place = 0;
+                bool fits = true;
+                for (uint32_t k = 0; k < n && fits; ++k) {
+                    uint16_t c = target + k;
+                    if (chain.clusters[k] == c)
+                        ++in_place;
+                    else if (!allocator.is_free(c))
+                        fits = false;
+                }
+                if (fits && n - in_place < best.moves) {
+                    best.target = target;
+                    best.moves = n - in_place;
+                }
+            }
+            if (best.moves <= n)
+                return true;
+
+            int region = allocator.allocate_contiguous(n);
+            if (region < 0)
+                return false;
+            for (uint32_t k = 0; k < n; ++k)
+                allocator.mark_free(region + k); // claimed by set_fat() below
+            best.target = region;
+            best.moves = n;
+            return true;
+        };
+
+        uint32_t moved_chains = 0, moved_clusters = 0, skipped = 0;
+        bool dirs_moved = false;
+
+        auto relocate = [&](Chain& chain) {
+            Placement to;
+            if (!place(chain, to)) {
+                FAT12_WARN("No contiguous free space for " << chain.path << " (" << chain.clusters.size() << " clusters)");
+                ++skipped;
+                return;
+            }
+
+            // every cluster copied lands on a free one, nothing is overwritten
+            uint32_t n = chain.clusters.size();
+            for (uint32_t k = 0; k < n; ++k) {
+                uint16_t c = to.target + k;
+                if (chain.clusters[k] != c) {
+                    std::memcpy(cluster_ptr(c), cluster_ptr(chain.clusters[k]), block_size_byte);
+                    mark_dirty(cluster_ptr(c), block_size_byte);
+                }
+            }
+            for (uint32_t k = 0; k < n; ++k) {
+                uint16_t old = chain.clusters[k];
+                if (old < to.target || old >= to.target + n)
+                    set_fat(old, FAT_ENTRY_UNUSED);
+            }
+            for (uint32_t k = 0; k < n; ++k)
+                set_fat(to.target + k, k + 1 < n ? to.target + k + 1 : EOC_MARKER);
+            stats.add(STAT_CLUSTERS_ALLOCATED, to.moves);
+            stats.add(STAT_CLUSTERS_FREED, to.moves);
+
+            uint16_t old_start = chain.entry->starting_cluster;
+            chain.entry->starting_cluster = to.target;
+            mark_dirty(chain.entry, sizeof(DirectoryEntry));
+
+            if (is_directory(*chain.entry) && old_start != to.target) {
+                // "." lives in the first slot, children point back with ".."
+                auto self = reinterpret_cast<DirectoryEntry*>(cluster_ptr(to.target));
+                self->starting_cluster = to.target;
+                mark_dirty(self, sizeof(DirectoryEntry));
+                for (auto& child : entries(chain.entry)) {
+                    if (child.filename[0] == '.' || !is_directory(child) || child.starting_cluster == 0)
+                        continue;
+                    auto parent_link = reinterpret_cast<DirectoryEntry*>(cluster_ptr(child.starting_cluster)) + 1;
+                    parent_link->starting_cluster = to.target;
+                    mark_dirty(parent_link, sizeof(DirectoryEntry));
+                }
+            }
+            dirs_moved |= is_directory(*chain.entry);
+
+            for (uint32_t k = 0; k < n; ++k)
+                chain.clusters[k] = to.target + k;
+            ++moved_chains;
+            moved_clusters += to.moves;
+        };
+
+        std::stable_sort(files.begin(), files.end(), [](const Chain& a, const Chain& b) {
+            return a.clusters.size() > b.clusters.size();
+        });
+        for (auto& chain : files) {
+            if (chain.extents > 1)
+                relocate(chain);
+        }
+        // walk_tree() lists parents before children
+        for (auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+            if (it->extents > 1)
+                relocate(*it);
+        }
+
+        extent_maps.clear();
+        // entries inside moved directories changed address
+        if (dirs_moved) {
+            dentries.clear();
+            dir_indexes.clear();
+        }
+
+        output() << "Defragmented " << moved_chains << " of " << fragmented << " chains, moved "
+                 << moved_clusters << " clusters";
+        if (skipped > 0)
+            output() << ", " << skipped << " skipped for lack of contiguous space";
+        output() << '\n';
+    }
+
+}//namespace
@@ -0,0 +1,48 @@
+#include "fat12_dir_index.hpp"
+#include <algorithm>
+#include <functional>
+
+namespace fat12 {
+
+    void DirIndex::add_free(size_t offset) {
+        auto it = std::lower_bound(free_slots.begin(), free_slots.end(), offset, std::greater<size_t>());
+        if (it == free_slots.end() || *it != offset)
+            free_slots.insert(it, offset);
+    }
+
+    bool DirIndex::find(const string& name, size_t& offset) const {
+        auto it = names.find(name);
+        if (it == names.end())
+            return false;
+        offset = it->second;
+        return true;
+    }
+
+    bool DirIndex::first_free(size_t& offset) const {
+        if (free_slots.empty())
+            return false;
+        offset = free_slots.back();
+        return true;
+    }
+
+    void DirIndex::take(size_t offset, const string& name) {
+        if (!free_slots.empty() && free_slots.back() == offset) {
+            free_slots.pop_back();
+        }
+        else {
+            auto it = std::lower_bound(free_slots.begin(), free_slots.end(), offset, std::greater<size_t>());
+            if (it != free_slots.end() && *it == offset)
+                free_slots.erase(it);
+        }
+        names[name] = offset;
+    }
+
+    void DirIndex::release(const string& name) {
+        auto it = names.find(name);
+        if (it == names.end())
+            return;
+        add_free(it->second);
+        names.erase(it);
+    }
+
+}//namespace
@@ -0,0 +1,136 @@
+#include "fat12_dir_scan.hpp"
+#include "fat12_utils.hpp"
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    #define FAT12_DIR_SCAN_X86 1
+    #include <immintrin.h>
+#endif
+
+namespace fat12 {
+
+    static bool slot_is_free(const DirectoryEntry& slot) {
+        unsigned char first = static_cast<unsigned char>(slot.filename[0]);
+        return first == DIR_NAME_FREE[0] || first == DIR_NAME_FREE[1];
+    }
+
+    static bool slot_has_name(const DirectoryEntry& slot, const char* key) {
+        return std::memcmp(slot.filename, key, ENTRY_NAME_LEN) == 0;
+    }
+
+    static int find_free_scalar(const DirectoryEntry* slots, int first, int cnt) {
+        for (int i = first; i < cnt; ++i) {
+            if (slot_is_free(slots[i]))
+                return i;
+        }
+        return -1;
+    }
+
+    static int find_name_scalar(const DirectoryEntry* slots, int first, int cnt, const char* key) {
+        for (int i = first; i < cnt; ++i) {
+            if (slots[i].filename[0] == key[0] && slot_has_name(slots[i], key))
+                return i;
+        }
+        return -1;
+    }
+
+#ifdef FAT12_DIR_SCAN_X86
+
+    // dword offsets of eight consecutive 32-byte entries
+    #define FAT12_SLOT_STRIDES _mm256_setr_epi32(0, 8, 16, 24, 32, 40, 48, 56)
+
+    __attribute__((target("avx2")))
+    static int find_free_avx2(const DirectoryEntry* slots, int cnt) {
+        const __m256i strides = FAT12_SLOT_STRIDES;
+        const __m256i low_byte = _mm256_set1_epi32(0xFF);
+        const __m256i deleted = _mm256_set1_epi32(DIR_NAME_FREE[0]);
+        const __m256i unused = _mm256_setzero_si256();
+
+        int i = 0;
+        for (; i + 8 <= cnt; i += 8) {
+            __m256i lead = _mm256_i32gather_epi32(reinterpret_cast<const int*>(&slots[i]), strides, 4);
+            lead = _mm256_and_si256(lead, low_byte);
+            __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi32(lead, unused), _mm256_cmpeq_epi32(lead, deleted));
+            int mask = _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+            if (mask != 0)
+                return i + __builtin_ctz(mask);
+        }
+        return find_free_scalar(slots, i, cnt);
+    }
+
+    // Bytes 0-7 of the name are compared eight entries at a time, the
+    // remaining three only for entries that passed
+    __attribute__((target("avx2")))
+    static int find_name_avx2(const DirectoryEntry* slots, int cnt, const char* key) {
+        const __m256i strides = FAT12_SLOT_STRIDES;
+        int32_t key_lo, key_hi;
+        std::memcpy(&key_lo, key, 4);
+        std::memcpy(&key_hi, key + 4, 4);
+        const __m256i want_lo = _mm256_set1_epi32(key_lo);
+        const __m256i want_hi = _mm256_set1_epi32(key_hi);
+
+        int i = 0;
+        for (; i + 8 <= cnt; i += 8) {
+            const int* base = reinterpret_cast<const int*>(&slots[i]);
+            __m256i lo = _mm256_i32gather_epi32(base, strides, 4);
+            __m256i hi = _mm256_i32gather_epi32(base + 1, strides, 4);
+            __m256i hit = _mm256_and_si256(_mm256_cmpeq_epi32(lo, want_lo), _mm256_cmpeq_epi32(hi, want_hi));
+            int mask = _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+            while (mask != 0) {
+                int j = i + __builtin_ctz(mask);
+                if (slot_has_name(slots[j], key))
+                    return j;
+                mask &= mask - 1;
+            }
+        }
+        return find_name_scalar(slots, i, cnt, key);
+    }
+
+    #undef FAT12_SLOT_STRIDES
+
+#endif
+
+    static bool use_avx2() {
+#ifdef FAT12_DIR_SCAN_X86
+        static bool supported = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+        return supported;
+#else
+        return false;
+#endif
+    }
+
+    int find_free_slot(const DirectoryEntry* slots, int cnt) {
+#ifdef FAT12_DIR_SCAN_X86
+        if (use_avx2())
+            return find_free_avx2(slots, cnt);
+#endif
+        return find_free_scalar(slots, 0, cnt);
+    }
+
+    int find_name_slot(const DirectoryEntry* slots, int cnt, const char* key) {
+#ifdef FAT12_DIR_SCAN_X86
+        if (use_avx2())
+            return find_name_avx2(slots, cnt, key);
+#endif
+        return find_name_scalar(slots, 0, cnt, key);
+    }
+
+    int find_free_slot_scalar(const DirectoryEntry* slots, int cnt) {
+        return find_free_scalar(slots, 0, cnt);
+    }
+
+    int find_name_slot_scalar(const DirectoryEntry* slots, int cnt, const char* key) {
+        return find_name_scalar(slots, 0, cnt, key);
+    }
+
+    void make_name_key(const string& name, char* key) {
+        check_entry_name(name);
+        std::memset(key, 0, ENTRY_NAME_LEN);
+        std::memcpy(key, name.data(), name.size());
+    }
+
+    const char* dir_scan_kernel_name() {
+        return use_avx2() ? "avx2" : "scalar";
+    }
+
+}//namespace
@@ -0,0 +1,41 @@
+#include "fat12_dirty_ranges.hpp"
+
+namespace fat12 {
+
+    void DirtyRanges::add(size_t offset, size_t len) {
+        if (len == 0)
+            return;
+
+        size_t start = offset;
+        size_t end = offset + len;
+
+        // Merge with a preceding range that overlaps or touches us
+        auto it = ranges.upper_bound(start);
+        if (it != ranges.begin()) {
+            auto prev = std::prev(it);
+            if (prev->second >= start) {
+                if (prev->second >= end)
+                    return; // already covered
+                start = prev->first;
+                it = ranges.erase(prev);
+            }
+        }
+
+        // Swallow every following range that starts inside [start, end]
+        while (it != ranges.end() && it->first <= end) {
+            if (it->second > end)
+                end = it->second;
+            it = ranges.erase(it);
+        }
+
+        ranges[start] = end;
+    }
+
+    size_t DirtyRanges::bytes() const {
+        size_t total = 0;
+        for (auto& range : ranges)
+            total += range.second - range.first;
+        return total;
+    }
+
+}//namespace
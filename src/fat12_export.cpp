@@ -0,0 +1,147 @@
+#include "fat12.hpp"
+#include "fat12_log.hpp"
+#include "fat12_parallel.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fat12 {
+
+    namespace {
+
+        struct ExportFile {
+            string host_path;
+            std::vector<std::pair<const char*, size_t>> runs;
+            mode_t mode;
+            std::time_t mtime;
+        };
+
+        const size_t EXPORT_GRAIN = 4; // files per work item
+
+        void make_host_dir(const string& path) {
+            if (::mkdir(path.c_str(), 0755) == 0)
+                return;
+            struct stat st;
+            if (errno == EEXIST && stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+                return;
+            throw std::runtime_error("Error creating directory: " + path + ": " + std::strerror(errno));
+        }
+
+        void set_host_mtime(int fd, const string& path, std::time_t mtime) {
+            struct timespec times[2];
+            times[0].tv_sec = times[1].tv_sec = mtime;
+            times[0].tv_nsec = times[1].tv_nsec = 0;
+            int rc = fd >= 0 ? futimens(fd, times) : utimensat(AT_FDCWD, path.c_str(), times, 0);
+            if (rc < 0) {
+                FAT12_WARN("Cannot set the time of " << path << ": " << std::strerror(errno));
+            }
+        }
+
+        // Positioned writes straight out of the image, one pwrite per run
+        void copy_out(const ExportFile& file) {
+            int fd = ::open(file.host_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                throw std::runtime_error("Error opening file: " + file.host_path + ": " + std::strerror(errno));
+            }
+
+            off_t offset = 0;
+            for (auto& run : file.runs) {
+                size_t done = 0;
+                while (done < run.second) {
+                    ssize_t n = ::pwrite(fd, run.first + done, run.second - done, offset + done);
+                    if (n < 0) {
+                        if (errno == EINTR)
+                            continue;
+                        ::close(fd);
+                        throw std::runtime_error("Error writing output file: " + file.host_path + ": " + std::strerror(errno));
+                    }
+                    done += n;
+                }
+                offset += run.second;
+            }
+
+            if (fchmod(fd, file.mode) < 0) {
+                FAT12_WARN("Cannot set the mode of " << file.host_path << ": " << std::strerror(errno));
+            }
+            set_host_mtime(fd, file.host_path, file.mtime);
+            ::close(fd);
+        }
+
+    }//namespace
+
+    /*
+        export <fat_path> <linux_dir>
+        Copy the contents of an image directory under a host directory,
+        created if missing. The subtree is walked once to create the host
+        directories and collect the cluster runs of every file, then files
+        are written by worker threads with pwrite straight from the image.
+        Modification times and the R/W attributes carry over; directory
+        times are set last, deepest first, since writing into a directory
+        bumps its time.
+        A file whose chain doesn't cover its size, or a directory that
+        can't be read, fails the export before any file content is written.
+    */
+    void fat12_fs::export_tree(const string& param) {
+        std::istringstream iss(param);
+        string fat_path, host_dir;
+        if (!(iss >> fat_path >> host_dir)) {
+            throw std::invalid_argument("Usage: export <fat_path> <linux_dir>");
+        }
+
+        DirectoryEntry* source = find_dir_recursive(tokenize(fat_path));
+        if (source == nullptr) {
+            throw std::invalid_argument("Invalid folder path: " + fat_path);
+        }
+        make_host_dir(host_dir);
+
+        std::vector<ExportFile> files;
+        std::vector<std::pair<string, std::time_t>> dirs;
+        uint64_t bytes = 0;
+
+        walk_tree(source, host_dir, [&](DirectoryEntry& entry, const string& path) {
+            if (is_directory(entry)) {
+                make_host_dir(path);
+                dirs.push_back(std::make_pair(path, get_time(&entry.last_modification)));
+                return;
+            }
+
+            ExportFile file;
+            file.host_path = path;
+            file.mode = attributes_linux_mode(entry.attributes);
+            file.mtime = get_time(&entry.last_modification);
+
+            uint32_t remaining = entry.file_size;
+            if (remaining != 0) {
+                for (auto& run : get_chain_runs(entry.starting_cluster)) {
+                    if (remaining == 0)
+                        break;
+                    size_t run_bytes = static_cast<size_t>(run.count) * block_size_byte;
+                    size_t len = remaining < run_bytes ? remaining : run_bytes;
+                    file.runs.push_back(std::make_pair(reinterpret_cast<const char*>(cluster_ptr(run.start)), len));
+                    remaining -= len;
+                }
+            }
+            if (remaining != 0) {
+                throw std::runtime_error("Cluster chain is shorter than file size: " + path);
+            }
+            bytes += entry.file_size;
+            files.push_back(std::move(file));
+        });
+
+        parallel_for(files.size(), EXPORT_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i)
+                copy_out(files[i]);
+        });
+
+        for (auto it = dirs.rbegin(); it != dirs.rend(); ++it)
+            set_host_mtime(-1, it->first, it->second);
+
+        stats.add(STAT_BYTES_OUT, bytes);
+        output() << "Exported " << files.size() << " files and " << dirs.size() << " directories ("
+                 << bytes << " bytes) to " << host_dir << '\n';
+    }
+
+}//namespace
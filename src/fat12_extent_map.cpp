@@ -0,0 +1,69 @@
+#include "fat12_extent_map.hpp"
+#include "fat12_utils.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+namespace fat12 {
+
+    uint32_t ExtentMap::build(const FatEntry* fat, int cluster_cnt, uint16_t start) {
+        runs.clear();
+        blocks = 0;
+
+        uint16_t cluster = start;
+        int hops = 0;
+        while (true) {
+            if (cluster < FAT_RESERVED_CNT || cluster >= cluster_cnt || hops++ >= cluster_cnt) {
+                throw std::runtime_error("Corrupted cluster chain at cluster " + std::to_string(cluster));
+            }
+            append(cluster);
+
+            FatEntry next = fat[cluster];
+            if (is_last_cluster(next))
+                break;
+            cluster = next;
+        }
+        return hops;
+    }
+
+    size_t ExtentMap::find(uint32_t block) const {
+        if (block >= blocks)
+            return runs.size();
+        auto it = std::upper_bound(runs.begin(), runs.end(), block,
+                                   [](uint32_t b, const Extent& e) { return b < e.logical; });
+        return (it - runs.begin()) - 1;
+    }
+
+    uint16_t ExtentMap::cluster_at(uint32_t block) const {
+        size_t idx = find(block);
+        if (idx == runs.size())
+            return 0;
+        return runs[idx].start + (block - runs[idx].logical);
+    }
+
+    void ExtentMap::append(uint16_t cluster) {
+        if (!runs.empty() && runs.back().start + runs.back().count == cluster && runs.back().count < UINT16_MAX) {
+            runs.back().count++;
+        }
+        else {
+            Extent extent = { blocks, cluster, 1 };
+            runs.push_back(extent);
+        }
+        blocks++;
+    }
+
+    void ExtentMap::truncate(uint32_t cnt) {
+        if (cnt >= blocks)
+            return;
+        size_t idx = find(cnt);
+        if (cnt == runs[idx].logical) {
+            runs.resize(idx);
+        }
+        else {
+            runs[idx].count = cnt - runs[idx].logical;
+            runs.resize(idx + 1);
+        }
+        blocks = cnt;
+    }
+
+}//namespace
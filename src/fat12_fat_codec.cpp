@@ -0,0 +1,192 @@
+#include "fat12_fat_codec.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    #define FAT12_CODEC_X86 1
+    #include <immintrin.h>
+#endif
+
+namespace fat12 {
+
+    // 0xFF0-0xFFF -> 0xFFF0-0xFFFF
+    static inline FatEntry widen_marker(FatEntry value) {
+        return value >= FAT12_ENTRY_LIMIT ? value | 0xF000 : value;
+    }
+
+    FatEntry get_packed_entry(const uint8_t* packed, size_t idx) {
+        const uint8_t* p = packed + idx * 3 / 2;
+        if (idx & 1)
+            return widen_marker((p[0] >> 4) | (p[1] << 4));
+        return widen_marker(p[0] | ((p[1] & 0x0F) << 8));
+    }
+
+    void set_packed_entry(uint8_t* packed, size_t idx, FatEntry value) {
+        uint8_t* p = packed + idx * 3 / 2;
+        if (idx & 1) {
+            p[0] = (p[0] & 0x0F) | ((value & 0x0F) << 4);
+            p[1] = (value >> 4) & 0xFF;
+        }
+        else {
+            p[0] = value & 0xFF;
+            p[1] = (p[1] & 0xF0) | ((value >> 8) & 0x0F);
+        }
+    }
+
+    void encode_fat12(const FatEntry* table, uint8_t* packed, size_t first, size_t last) {
+        // whole byte triples need no read-modify-write
+        size_t idx = first;
+        if ((idx & 1) && idx < last) {
+            set_packed_entry(packed, idx, table[idx]);
+            ++idx;
+        }
+        for (; idx + 2 <= last; idx += 2) {
+            uint8_t* p = packed + idx * 3 / 2;
+            FatEntry lo = table[idx], hi = table[idx + 1];
+            p[0] = lo & 0xFF;
+            p[1] = ((lo >> 8) & 0x0F) | ((hi & 0x0F) << 4);
+            p[2] = (hi >> 4) & 0xFF;
+        }
+        if (idx < last)
+            set_packed_entry(packed, idx, table[idx]);
+    }
+
+    static void decode_scalar(const uint8_t* packed, FatEntry* table, size_t first, size_t cnt) {
+        for (size_t idx = first; idx < cnt; ++idx)
+            table[idx] = get_packed_entry(packed, idx);
+    }
+
+#ifdef FAT12_CODEC_X86
+
+    // 12 packed bytes -> 8 entries: spread each entry's two source bytes
+    // into a 16-bit lane, then mask even lanes and shift odd lanes by 4
+    __attribute__((target("ssse3")))
+    static void decode_ssse3(const uint8_t* packed, FatEntry* table, size_t cnt) {
+        const __m128i spread = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+        const __m128i even = _mm_setr_epi16(0x0FFF, 0, 0x0FFF, 0, 0x0FFF, 0, 0x0FFF, 0);
+        const __m128i odd = _mm_setr_epi16(0, -1, 0, -1, 0, -1, 0, -1);
+        const __m128i below_marker = _mm_set1_epi16(FAT12_ENTRY_LIMIT - 1);
+        const __m128i marker_bits = _mm_set1_epi16(static_cast<short>(0xF000));
+        size_t len = packed_fat_size(cnt);
+
+        size_t idx = 0;
+        // each step loads 16 bytes but consumes 12
+        for (; idx + 8 <= cnt && idx / 2 * 3 + 16 <= len; idx += 8) {
+            __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(packed + idx / 2 * 3));
+            __m128i words = _mm_shuffle_epi8(raw, spread);
+            __m128i lo = _mm_and_si128(words, even);
+            __m128i hi = _mm_and_si128(_mm_srli_epi16(words, 4), odd);
+            __m128i entries = _mm_or_si128(lo, hi);
+            // entries are at most 0xFFF, so the signed compare is safe
+            __m128i marker = _mm_cmpgt_epi16(entries, below_marker);
+            entries = _mm_or_si128(entries, _mm_and_si128(marker, marker_bits));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(table + idx), entries);
+        }
+        decode_scalar(packed, table, idx, cnt);
+    }
+
+    // Same kernel on both 128-bit lanes, 24 packed bytes -> 16 entries
+    __attribute__((target("avx2")))
+    static void decode_avx2(const uint8_t* packed, FatEntry* table, size_t cnt) {
+        const __m256i spread = _mm256_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11,
+                                                0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+        const __m256i even = _mm256_setr_epi16(0x0FFF, 0, 0x0FFF, 0, 0x0FFF, 0, 0x0FFF, 0,
+                                               0x0FFF, 0, 0x0FFF, 0, 0x0FFF, 0, 0x0FFF, 0);
+        const __m256i odd = _mm256_setr_epi16(0, -1, 0, -1, 0, -1, 0, -1,
+                                              0, -1, 0, -1, 0, -1, 0, -1);
+        const __m256i below_marker = _mm256_set1_epi16(FAT12_ENTRY_LIMIT - 1);
+        const __m256i marker_bits = _mm256_set1_epi16(static_cast<short>(0xF000));
+        size_t len = packed_fat_size(cnt);
+
+        size_t idx = 0;
+        // the upper lane loads 16 bytes at offset 12
+        for (; idx + 16 <= cnt && idx / 2 * 3 + 28 <= len; idx += 16) {
+            const uint8_t* src = packed + idx / 2 * 3;
+            __m128i lo_raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+            __m128i hi_raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 12));
+            __m256i raw = _mm256_inserti128_si256(_mm256_castsi128_si256(lo_raw), hi_raw, 1);
+            __m256i words = _mm256_shuffle_epi8(raw, spread);
+            __m256i lo = _mm256_and_si256(words, even);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(words, 4), odd);
+            __m256i entries = _mm256_or_si256(lo, hi);
+            __m256i marker = _mm256_cmpgt_epi16(entries, below_marker);
+            entries = _mm256_or_si256(entries, _mm256_and_si256(marker, marker_bits));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(table + idx), entries);
+        }
+        decode_scalar(packed, table, idx, cnt);
+    }
+
+#endif
+
+    typedef void (*DecodeKernel)(const uint8_t*, FatEntry*, size_t);
+
+    static void decode_portable(const uint8_t* packed, FatEntry* table, size_t cnt) {
+        decode_scalar(packed, table, 0, cnt);
+    }
+
+    static DecodeKernel select_decoder(const char** name) {
+#ifdef FAT12_CODEC_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            *name = "avx2";
+            return decode_avx2;
+        }
+        if (__builtin_cpu_supports("ssse3")) {
+            *name = "ssse3";
+            return decode_ssse3;
+        }
+#endif
+        *name = "scalar";
+        return decode_portable;
+    }
+
+    static const char* decoder_name = nullptr;
+
+    static DecodeKernel decoder() {
+        static DecodeKernel kernel = select_decoder(&decoder_name);
+        return kernel;
+    }
+
+    void decode_fat12(const uint8_t* packed, FatEntry* table, size_t cnt) {
+        decoder()(packed, table, cnt);
+    }
+
+    FatEntry get_fat_entry(int fat_bits, const uint8_t* packed, size_t idx) {
+        if (fat_bits == 12)
+            return get_packed_entry(packed, idx);
+        return packed[idx * 2] | (packed[idx * 2 + 1] << 8);
+    }
+
+    void set_fat_entry(int fat_bits, uint8_t* packed, size_t idx, FatEntry value) {
+        if (fat_bits == 12) {
+            set_packed_entry(packed, idx, value);
+            return;
+        }
+        packed[idx * 2] = value & 0xFF;
+        packed[idx * 2 + 1] = value >> 8;
+    }
+
+    void decode_fat(int fat_bits, const uint8_t* packed, FatEntry* table, size_t cnt) {
+        if (fat_bits == 12) {
+            decode_fat12(packed, table, cnt);
+            return;
+        }
+        for (size_t idx = 0; idx < cnt; ++idx)
+            table[idx] = packed[idx * 2] | (packed[idx * 2 + 1] << 8);
+    }
+
+    void encode_fat(int fat_bits, const FatEntry* table, uint8_t* packed, size_t first, size_t last) {
+        if (fat_bits == 12) {
+            encode_fat12(table, packed, first, last);
+            return;
+        }
+        for (size_t idx = first; idx < last; ++idx) {
+            packed[idx * 2] = table[idx] & 0xFF;
+            packed[idx * 2 + 1] = table[idx] >> 8;
+        }
+    }
+
+    const char* fat_decoder_name() {
+        decoder();
+        return decoder_name;
+    }
+
+}//namespace
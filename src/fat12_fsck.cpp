@@ -0,0 +1,297 @@
+#include "fat12.hpp"
+#include "fat12_log.hpp"
+#include "fat12_parallel.hpp"
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+
+namespace fat12 {
+
+    namespace {
+
+        // Outcome of walking one entry's cluster chain
+        struct ChainCheck {
+            enum Status { CHAIN_OK, BAD_START, BROKEN, LOOP, CROSS_LINKED };
+
+            Status status;
+            uint32_t length;    // clusters owned by this entry
+            uint16_t last;      // last cluster owned, 0 if none
+            uint16_t at;        // cluster where the walk stopped on a problem
+            int other;          // owning entry of a cross-linked cluster
+        };
+
+        const size_t FSCK_GRAIN = 64; // entries or FAT ranges per work item
+
+    }//namespace
+
+    /*
+        Check the mounted image. The directory tree is walked once to list
+        every file and directory, then chains are walked in parallel: a
+        first pass hands each cluster to the earliest entry reaching it, a
+        second one finds loops and the clusters an entry reaches but
+        doesn't own (cross-links), so reports and repairs come out the
+        same on every run. FAT1 (the shadow table) is compared against the
+        packed FAT2 and clusters in use that no entry owns are reported as
+        lost chains. With "-r" (or "repair") FAT2 is rewritten from FAT1,
+        broken and cross-linked chains are cut, entries owning none of
+        their chain are emptied (files) or dropped (directories), file
+        sizes are fitted to their chains and lost clusters are freed.
+        Returns the number of problems found.
+    */
+    int fat12_fs::fsck(const string& param) {
+        bool repair = (param == "-r" || param == "repair");
+        if (!param.empty() && !repair) {
+            throw std::invalid_argument("Usage: fsck [-r]");
+        }
+
+        flush_fat(); // packed FAT1 now matches the shadow table
+
+        std::vector<DirectoryEntry*> entries;
+        std::vector<string> paths;
+        // a directory that can't be read is still checked as an entry of its parent
+        walk_tree(&root_dir, "", [&](DirectoryEntry& entry, const string& path) {
+            entries.push_back(&entry);
+            paths.push_back(path);
+        }, [](const string& path, const std::runtime_error& e) {
+            FAT12_WARN("Skipping " << path << ": " << e.what());
+        });
+
+        // - Give every cluster to the earliest entry (in walk order) whose
+        //   chain reaches it. Claims only ever lower the owner, so the
+        //   result doesn't depend on which thread gets there first. A walk
+        //   stops where an earlier entry, or the entry itself, was before.
+        std::vector<std::atomic<int>> owner(cluster_cnt);
+        for (auto& o : owner)
+            o.store(-1, std::memory_order_relaxed);
+
+        parallel_for(entries.size(), FSCK_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; ++k) {
+                int self = static_cast<int>(k);
+                uint16_t cluster = entries[k]->starting_cluster;
+                while (cluster >= FAT_RESERVED_CNT && cluster < cluster_cnt) {
+                    int current = owner[cluster].load(std::memory_order_relaxed);
+                    bool claimed = false;
+                    while (!claimed && (current < 0 || current > self))
+                        claimed = owner[cluster].compare_exchange_weak(current, self);
+                    if (!claimed)
+                        break;
+
+                    FatEntry next = FAT[cluster];
+                    if (is_last_cluster(next))
+                        break;
+                    cluster = next;
+                }
+            }
+        });
+
+        // - Walk every chain again against the settled owners. Each cluster
+        //   is walked by its owner only, which marks it in visited.
+        std::vector<int> visited(cluster_cnt, -1);
+        std::vector<ChainCheck> chains(entries.size());
+
+        parallel_for(entries.size(), FSCK_GRAIN, [&](size_t begin, size_t end) {
+            for (size_t k = begin; k < end; ++k) {
+                ChainCheck& check = chains[k];
+                check.status = ChainCheck::CHAIN_OK;
+                check.length = 0;
+                check.last = 0;
+                check.other = -1;
+
+                uint16_t cluster = entries[k]->starting_cluster;
+                check.at = cluster;
+                if (cluster < FAT_RESERVED_CNT || cluster >= cluster_cnt) {
+                    check.status = ChainCheck::BAD_START;
+                    continue;
+                }
+
+                while (true) {
+                    int first = owner[cluster].load(std::memory_order_relaxed);
+                    if (first != static_cast<int>(k) || visited[cluster] == first) {
+                        check.status = first == static_cast<int>(k) ? ChainCheck::LOOP : ChainCheck::CROSS_LINKED;
+                        check.other = first;
+                        check.at = cluster;
+                        break;
+                    }
+                    visited[cluster] = first;
+                    check.length++;
+                    check.last = cluster;
+
+                    FatEntry next = FAT[cluster];
+                    if (is_last_cluster(next))
+                        break;
+                    if (next < FAT_RESERVED_CNT || next >= cluster_cnt) {
+                        check.status = ChainCheck::BROKEN;
+                        check.at = next;
+                        break;
+                    }
+                    cluster = next;
+                }
+            }
+        });
+
+        // - FAT1 against FAT2, and clusters in use nobody owns
+        std::vector<FatEntry> fat2(cluster_cnt);
+        decode_fat(fat_bits, reinterpret_cast<uint8_t*>(&fs_buffer[fat2_start]), fat2.data(), cluster_cnt);
+        std::atomic<int> fat_mismatches(0);
+        std::vector<char> lost(cluster_cnt, 0);
+
+        size_t range = FSCK_GRAIN * 16;
+        parallel_for(cluster_cnt, range, [&](size_t begin, size_t end) {
+            int mismatches = 0;
+            for (size_t c = begin; c < end; ++c) {
+                if (FAT[c] != fat2[c])
+                    ++mismatches;
+                if (c >= static_cast<size_t>(FAT_RESERVED_CNT) && FAT[c] != FAT_ENTRY_UNUSED &&
+                        FAT[c] != FAT_ENTRY_BAD_CLUSTER && owner[c].load(std::memory_order_relaxed) < 0)
+                    lost[c] = 1;
+            }
+            fat_mismatches += mismatches;
+        });
+
+        // - Report, and repair when asked
+        int problems = 0;
+        int repaired = 0;
+        int file_cnt = 0;
+        int dir_cnt = 0;
+
+        if (fat_mismatches > 0) {
+            ++problems;
+            output() << "FAT1 and FAT2 differ in " << fat_mismatches << " entries\n";
+            if (repair) {
+                fat_dirty.add(0, cluster_cnt); // re-encode both copies from FAT1
+                ++repaired;
+            }
+        }
+
+        for (size_t k = 0; k < entries.size(); ++k) {
+            DirectoryEntry* entry = entries[k];
+            ChainCheck& check = chains[k];
+            bool directory = is_directory(*entry);
+            directory ? ++dir_cnt : ++file_cnt;
+
+            switch (check.status) {
+            case ChainCheck::CHAIN_OK:
+                break;
+            case ChainCheck::BAD_START:
+                ++problems;
+                output() << paths[k] << ": invalid starting cluster " << check.at << "\n";
+                break;
+            case ChainCheck::BROKEN:
+                ++problems;
+                output() << paths[k] << ": chain broken after cluster " << check.last
+                         << " (next " << check.at << ")\n";
+                break;
+            case ChainCheck::LOOP:
+                ++problems;
+                output() << paths[k] << ": chain loops back to cluster " << check.at << "\n";
+                break;
+            case ChainCheck::CROSS_LINKED:
+                ++problems;
+                output() << paths[k] << ": cluster " << check.at << " is cross-linked with "
+                         << paths[check.other] << "\n";
+                break;
+            }
+
+            if (repair && check.status != ChainCheck::CHAIN_OK && check.last != 0) {
+                set_fat(check.last, EOC_MARKER); // keep what this entry owns
+                ++repaired;
+            }
+            else if (repair && check.status != ChainCheck::CHAIN_OK) {
+                // nothing of the chain is its own: a file starts over empty,
+                // a directory (or a file on a full volume) is dropped
+                if (!directory && allocator.free_count() > 0) {
+                    uint16_t cluster = reserve_cluster();
+                    std::memset(cluster_ptr(cluster), 0, block_size_byte);
+                    mark_dirty(cluster_ptr(cluster), block_size_byte);
+                    entry->starting_cluster = cluster;
+                    entry->file_size = 0;
+                }
+                else {
+                    entry->filename[0] = DIR_NAME_FREE[0];
+                }
+                mark_dirty(entry, sizeof(DirectoryEntry));
+                ++repaired;
+                continue;
+            }
+
+            if (directory || check.status == ChainCheck::BAD_START)
+                continue;
+
+            uint32_t expected = (entry->file_size + block_size_byte - 1) / block_size_byte;
+            if (expected == 0)
+                expected = 1; // every file owns at least one cluster
+            if (expected == check.length)
+                continue;
+
+            // a chain reported above is only fitted to its size, not counted twice
+            if (check.status == ChainCheck::CHAIN_OK) {
+                ++problems;
+                output() << paths[k] << ": size " << entry->file_size << " needs " << expected
+                         << " clusters, chain has " << check.length << "\n";
+            }
+            if (!repair)
+                continue;
+
+            if (check.length < expected) {
+                entry->file_size = check.length * block_size_byte;
+                mark_dirty(entry, sizeof(DirectoryEntry));
+            }
+            else {
+                uint16_t cluster = entry->starting_cluster;
+                for (uint32_t i = 1; i < expected; ++i)
+                    cluster = FAT[cluster];
+                uint16_t tail = FAT[cluster];
+                set_fat(cluster, EOC_MARKER);
+                free_chain(tail);
+            }
+            if (check.status == ChainCheck::CHAIN_OK)
+                ++repaired;
+        }
+
+        // lost chains start at a lost cluster no other lost cluster points to
+        std::vector<char> pointed(cluster_cnt, 0);
+        int lost_cnt = 0;
+        for (int c = FAT_RESERVED_CNT; c < cluster_cnt; ++c) {
+            if (!lost[c])
+                continue;
+            ++lost_cnt;
+            FatEntry next = FAT[c];
+            if (next >= FAT_RESERVED_CNT && next < cluster_cnt && lost[next])
+                pointed[next] = 1;
+        }
+        if (lost_cnt > 0) {
+            int heads = 0;
+            for (int c = FAT_RESERVED_CNT; c < cluster_cnt; ++c) {
+                if (lost[c] && !pointed[c])
+                    ++heads;
+            }
+            ++problems;
+            output() << lost_cnt << " lost clusters in " << heads << " chains\n";
+            if (repair) {
+                for (int c = FAT_RESERVED_CNT; c < cluster_cnt; ++c) {
+                    if (lost[c])
+                        set_fat(c, FAT_ENTRY_UNUSED);
+                }
+                ++repaired;
+            }
+        }
+
+        output() << "fsck " << name << ": " << file_cnt << " files, " << dir_cnt << " directories, "
+                 << (cluster_cnt - FAT_RESERVED_CNT - allocator.free_count()) << "/" << (cluster_cnt - FAT_RESERVED_CNT)
+                 << " clusters used, " << problems << " problems";
+        if (repair)
+            output() << ", " << repaired << " repaired";
+        output() << "\n";
+        if (repaired > 0) {
+            // chains were cut or trimmed and entries dropped, cached slots
+            // may point into clusters a directory no longer owns
+            extent_maps.clear();
+            dentries.clear();
+            dir_indexes.clear();
+        }
+
+        FAT12_INFO("fsck checked " << entries.size() << " entries on " << worker_count() << " threads");
+        return problems;
+    }
+
+}//namespace
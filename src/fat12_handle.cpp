@@ -0,0 +1,273 @@
+#include "fat12.hpp"
+#include "fat12_log.hpp"
+#include <stdexcept>
+
+namespace fat12 {
+
+    /*
+        File handles. A handle keeps the offset of the file's directory
+        entry. write over the file and del refuse open files, defrag
+        refuses to run with handles open. Bytes past file_size in the last
+        cluster are kept zero, so growing a file needs no extra clearing
+        of the gap between the old end and a write offset. read_at() and
+        stat() share fs_lock and the lock of the file's directory, so
+        commands replacing the file wait for them; calls that change
+        anything hold fs_lock exclusively.
+    */
+
+    int fat12_fs::open(const string& path, int mode) {
+        if (!(mode & (OPEN_READ | OPEN_WRITE))) {
+            throw std::invalid_argument("Open mode needs OPEN_READ or OPEN_WRITE");
+        }
+        if ((mode & (OPEN_CREATE | OPEN_TRUNC)) && !(mode & OPEN_WRITE)) {
+            throw std::invalid_argument("OPEN_CREATE and OPEN_TRUNC need OPEN_WRITE");
+        }
+        RwGuard guard(fs_lock, true);
+
+        auto path_tokens = tokenize(path);
+        string fname = path_tokens[path_tokens.size()-1]; // last token
+        path_tokens.pop_back(); // remove last token, i.e file name
+
+        auto target_dir = find_dir_recursive(path_tokens);
+        if (target_dir == nullptr) {
+            throw std::invalid_argument("Invalid folder path: " + path);
+        }
+
+        auto entry = find_entry(target_dir, fname);
+        if (entry == nullptr) {
+            if (!(mode & OPEN_CREATE)) {
+                throw std::invalid_argument("No such file: " + path);
+            }
+            entry = find_empty_dir(target_dir);
+            if (entry == nullptr) {
+                throw std::runtime_error("No free directory entry for " + path);
+            }
+            create_file(entry, target_dir, fname);
+            entry->attributes = ATTR_READABLE | ATTR_WRITABLE;
+            try {
+                resize_chain(entry, 1); // every file owns at least one cluster
+            } catch (...) {
+                release_slot(target_dir, entry, fname);
+                throw;
+            }
+        }
+        else if (is_directory(*entry)) {
+            throw std::invalid_argument("Is a directory: " + path);
+        }
+
+        if ((mode & OPEN_READ) && !is_readable(*entry)) {
+            throw std::runtime_error("Target file does not have read permission!");
+        }
+        if ((mode & OPEN_WRITE) && !is_writable(*entry)) {
+            throw std::runtime_error("Target file does not have write permission!");
+        }
+
+        if ((mode & OPEN_WRITE) && entry->starting_cluster < FAT_RESERVED_CNT)
+            resize_chain(entry, 1);
+
+        int handle = next_handle++;
+        OpenFile file = { buffer_offset(entry), dir_cluster(target_dir), mode };
+        open_files[handle] = file;
+
+        if (mode & OPEN_TRUNC)
+            resize_file(entry, 0);
+        return handle;
+    }
+
+    size_t fat12_fs::read_at(int handle, uint32_t offset, void* buf, size_t len) {
+        RwGuard guard(fs_lock, false);
+        OpenFile& file = open_file(handle);
+        if (!(file.mode & OPEN_READ)) {
+            throw std::runtime_error("File handle is not open for reading");
+        }
+        StripeGuard dir_guard(dir_locks, file.dir, false);
+
+        DirectoryEntry* entry = handle_entry(file);
+        if (offset >= entry->file_size || len == 0)
+            return 0;
+        if (len > entry->file_size - offset)
+            len = entry->file_size - offset;
+
+        transfer(file_extents(entry->starting_cluster), offset, len, nullptr, static_cast<char*>(buf));
+        stats.add(STAT_BYTES_OUT, len);
+        return len;
+    }
+
+    size_t fat12_fs::write_at(int handle, uint32_t offset, const void* buf, size_t len) {
+        RwGuard guard(fs_lock, true);
+        OpenFile& file = open_file(handle);
+        if (!(file.mode & OPEN_WRITE)) {
+            throw std::runtime_error("File handle is not open for writing");
+        }
+        if (len == 0)
+            return 0;
+        if (len > UINT32_MAX - offset) {
+            throw std::invalid_argument("Write past the 4 GB file size limit");
+        }
+
+        DirectoryEntry* entry = handle_entry(file);
+        uint32_t end = offset + len;
+        uint32_t cnt = (static_cast<uint64_t>(end) + block_size_byte - 1) / block_size_byte;
+        if (cnt > file_extents(entry->starting_cluster).block_count())
+            resize_chain(entry, cnt);
+
+        transfer(file_extents(entry->starting_cluster), offset, len, static_cast<const char*>(buf), nullptr);
+        if (end > entry->file_size)
+            entry->file_size = end;
+        set_time_date(&(entry->last_modification));
+        mark_dirty(entry, sizeof(DirectoryEntry));
+        stats.add(STAT_BYTES_IN, len);
+        return len;
+    }
+
+    void fat12_fs::truncate(int handle, uint32_t size) {
+        RwGuard guard(fs_lock, true);
+        OpenFile& file = open_file(handle);
+        if (!(file.mode & OPEN_WRITE)) {
+            throw std::runtime_error("File handle is not open for writing");
+        }
+        resize_file(handle_entry(file), size);
+    }
+
+    FileStat fat12_fs::stat(int handle) {
+        RwGuard guard(fs_lock, false);
+        OpenFile& file = open_file(handle);
+        StripeGuard dir_guard(dir_locks, file.dir, false);
+        DirectoryEntry* entry = handle_entry(file);
+
+        FileStat st;
+        st.size = entry->file_size;
+        st.clusters = 0;
+        st.extents = 0;
+        if (entry->starting_cluster >= FAT_RESERVED_CNT) {
+            const ExtentMap& map = file_extents(entry->starting_cluster);
+            st.clusters = map.block_count();
+            st.extents = map.extents().size();
+        }
+        st.attributes = entry->attributes;
+        st.created = get_time(&entry->creation);
+        st.modified = get_time(&entry->last_modification);
+        return st;
+    }
+
+    void fat12_fs::close(int handle) {
+        RwGuard guard(fs_lock, true);
+        if (open_files.erase(handle) == 0) {
+            throw std::invalid_argument("Bad file handle: " + std::to_string(handle));
+        }
+    }
+
+    fat12_fs::OpenFile& fat12_fs::open_file(int handle) {
+        auto it = open_files.find(handle);
+        if (it == open_files.end()) {
+            throw std::invalid_argument("Bad file handle: " + std::to_string(handle));
+        }
+        return it->second;
+    }
+
+    DirectoryEntry* fat12_fs::handle_entry(const OpenFile& file) {
+        return reinterpret_cast<DirectoryEntry*>(fs_buffer + file.entry_offset);
+    }
+
+    bool fat12_fs::is_open(const DirectoryEntry* entry) {
+        size_t offset = buffer_offset(entry);
+        for (auto& file : open_files) {
+            if (file.second.entry_offset == offset)
+                return true;
+        }
+        return false;
+    }
+
+    // Grow or cut a file's chain to cnt clusters. Growth takes the cluster
+    // right after the tail when it is free, so appends stay contiguous, and
+    // new clusters are zeroed.
+    void fat12_fs::resize_chain(DirectoryEntry* file, uint32_t cnt) {
+        if (file->starting_cluster < FAT_RESERVED_CNT) {
+            uint16_t first = reserve_cluster();
+            std::memset(cluster_ptr(first), 0, block_size_byte);
+            mark_dirty(cluster_ptr(first), block_size_byte);
+            file->starting_cluster = first;
+            mark_dirty(file, sizeof(DirectoryEntry));
+        }
+
+        ExtentMap& map = file_extents(file->starting_cluster);
+        if (cnt < map.block_count()) {
+            uint16_t last = map.cluster_at(cnt - 1);
+            uint16_t tail = FAT[last];
+            set_fat(last, EOC_MARKER);
+            free_chain(tail);
+            map.truncate(cnt);
+            return;
+        }
+
+        // fail before linking anything, a half grown chain would outlive file_size
+        if (cnt - map.block_count() > allocator.free_count()) {
+            throw std::runtime_error("Not enough free clusters on " + name);
+        }
+        while (map.block_count() < cnt) {
+            uint16_t last = map.last_cluster();
+            uint16_t next = last + 1;
+            if (next < cluster_cnt && allocator.is_free(next)) {
+                set_fat(next, EOC_MARKER);
+                stats.add(STAT_CLUSTERS_ALLOCATED);
+            }
+            else {
+                next = reserve_cluster();
+            }
+            set_fat(last, next);
+            std::memset(cluster_ptr(next), 0, block_size_byte);
+            mark_dirty(cluster_ptr(next), block_size_byte);
+            map.append(next);
+        }
+    }
+
+    // Set a file's size, cutting or growing its chain to match
+    void fat12_fs::resize_file(DirectoryEntry* entry, uint32_t size) {
+        uint32_t cnt = (static_cast<uint64_t>(size) + block_size_byte - 1) / block_size_byte;
+        resize_chain(entry, cnt == 0 ? 1 : cnt);
+
+        if (size < entry->file_size) {
+            // keep the bytes past the new end zero
+            ExtentMap& map = file_extents(entry->starting_cluster);
+            uint32_t kept = map.block_count() * block_size_byte;
+            uint32_t stale_end = entry->file_size < kept ? entry->file_size : kept;
+            if (stale_end > size) {
+                std::vector<char> zeros(stale_end - size, 0);
+                transfer(map, size, zeros.size(), zeros.data(), nullptr);
+            }
+        }
+        entry->file_size = size;
+        set_time_date(&(entry->last_modification));
+        mark_dirty(entry, sizeof(DirectoryEntry));
+    }
+
+    // Copy len bytes at offset from src into the file, or from the file
+    // into dst. One memcpy per extent touched, the range must be inside the chain.
+    void fat12_fs::transfer(ExtentMap& map, uint32_t offset, size_t len, const char* src, char* dst) {
+        const std::vector<Extent>& runs = map.extents();
+        size_t idx = map.find(offset / block_size_byte);
+        size_t done = 0;
+        while (done < len) {
+            if (idx >= runs.size()) {
+                throw std::runtime_error("Cluster chain is shorter than file size");
+            }
+            const Extent& run = runs[idx];
+            size_t pos = offset + done - static_cast<size_t>(run.logical) * block_size_byte;
+            size_t n = static_cast<size_t>(run.count) * block_size_byte - pos;
+            if (n > len - done)
+                n = len - done;
+
+            uint8_t* p = cluster_ptr(run.start) + pos;
+            if (src != nullptr) {
+                std::memcpy(p, src + done, n);
+                mark_dirty(p, n);
+            }
+            else {
+                std::memcpy(dst + done, p, n);
+            }
+            done += n;
+            ++idx;
+        }
+    }
+
+}//namespace
@@ -0,0 +1,259 @@
+#include "fat12.hpp"
+#include "fat12_log.hpp"
+#include "fat12_parallel.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fat12 {
+
+    namespace {
+
+        struct HostNode {
+            string host_path;
+            string name;
+            size_t parent;      // index of the parent directory node
+            bool directory;
+            uint32_t size;
+            mode_t mode;
+            time_t mtime;
+        };
+
+        const size_t IMPORT_GRAIN = 4; // files per work item
+
+        // List a host tree breadth first, so every parent precedes its
+        // children. Names are checked here, before the image is touched.
+        void list_host_tree(const string& root, std::vector<HostNode>& nodes) {
+            HostNode top = { root, "", 0, true, 0, 0, 0 };
+            nodes.push_back(top);
+
+            for (size_t i = 0; i < nodes.size(); ++i) {
+                if (!nodes[i].directory)
+                    continue;
+                string dir_path = nodes[i].host_path;
+
+                DIR* dir = opendir(dir_path.c_str());
+                if (dir == nullptr) {
+                    throw std::invalid_argument("Error opening directory: " + dir_path + ": " + std::strerror(errno));
+                }
+                std::vector<string> names;
+                while (dirent* entry = readdir(dir)) {
+                    string name = entry->d_name;
+                    if (name != "." && name != "..")
+                        names.push_back(name);
+                }
+                closedir(dir);
+                std::sort(names.begin(), names.end());
+
+                for (auto& name : names) {
+                    string path = dir_path + "/" + name;
+                    struct stat st;
+                    if (lstat(path.c_str(), &st) < 0) {
+                        throw std::runtime_error("Error reading " + path + ": " + std::strerror(errno));
+                    }
+                    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+                        FAT12_WARN("Skipping " << path << ": not a regular file or directory");
+                        continue;
+                    }
+                    if (name.size() > ENTRY_NAME_LEN) {
+                        throw std::invalid_argument("Name longer than 11 characters: " + path);
+                    }
+                    if (S_ISREG(st.st_mode) && st.st_size > UINT32_MAX) {
+                        throw std::invalid_argument("File too large: " + path);
+                    }
+
+                    HostNode node = { path, name, i, S_ISDIR(st.st_mode) != 0,
+                                      S_ISREG(st.st_mode) ? static_cast<uint32_t>(st.st_size) : 0,
+                                      st.st_mode, st.st_mtime };
+                    nodes.push_back(node);
+                }
+            }
+        }
+
+        // Fill a file's clusters from the host file, returns the bytes copied
+        uint32_t copy_in(const string& path, uint32_t size, const std::vector<std::pair<char*, size_t>>& runs) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("Error opening input file: " + path + ": " + std::strerror(errno));
+            }
+
+            uint32_t copied = 0;
+            try {
+                for (auto& run : runs) {
+                    size_t want = size - copied < run.second ? size - copied : run.second;
+                    copied += read_linux_run(fd, run.first, want, run.second, path);
+                }
+            } catch (...) {
+                ::close(fd);
+                throw;
+            }
+            ::close(fd);
+            return copied;
+        }
+
+    }//namespace
+
+    /*
+        import <linux_dir> <fat_path>
+        Copy the contents of a host directory tree under an existing
+        directory of the image. Directories are created and file slots
+        claimed first, then the clusters of every file are planned in one
+        pass over the free map (a single contiguous region when possible,
+        so each file lands contiguous), file contents are read in parallel
+        straight into their clusters and the entries are finalized last.
+        A failure before that point releases the claimed slots and chains
+        and removes the directories the import created.
+    */
+    void fat12_fs::import(const string& param) {
+        std::istringstream iss(param);
+        string host_dir, fat_path;
+        if (!(iss >> host_dir >> fat_path)) {
+            throw std::invalid_argument("Usage: import <linux_dir> <fat_path>");
+        }
+
+        std::vector<HostNode> nodes;
+        list_host_tree(host_dir, nodes);
+
+        DirectoryEntry* target = find_dir_recursive(tokenize(fat_path));
+        if (target == nullptr) {
+            throw std::invalid_argument("Invalid folder path: " + fat_path);
+        }
+
+        // - Directories and file slots, parents always come first
+        std::vector<DirectoryEntry*> fat_entries(nodes.size(), nullptr);
+        std::vector<size_t> files;
+        std::vector<size_t> dirs; // created by this import, parents first
+        fat_entries[0] = target;
+
+        auto rollback = [&]() {
+            for (size_t i : files) {
+                DirectoryEntry* entry = fat_entries[i];
+                if (entry->starting_cluster != 0)
+                    free_chain(entry->starting_cluster);
+                release_slot(fat_entries[nodes[i].parent], entry, nodes[i].name);
+            }
+            // deepest first, a directory's children are gone before it
+            for (auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+                DirectoryEntry* entry = fat_entries[*it];
+                uint16_t cluster = entry->starting_cluster;
+                free_chain(cluster);
+                release_slot(fat_entries[nodes[*it].parent], entry, nodes[*it].name);
+                std::lock_guard<std::mutex> guard(cache_lock);
+                dir_indexes.erase(cluster);
+            }
+        };
+
+        try {
+            for (size_t i = 1; i < nodes.size(); ++i) {
+                HostNode& node = nodes[i];
+                DirectoryEntry* parent = fat_entries[node.parent];
+                DirectoryEntry* existing = find_entry(parent, node.name);
+
+                if (node.directory && existing != nullptr) {
+                    if (!is_directory(*existing)) {
+                        throw std::invalid_argument("A file with the same name exists: " + node.host_path);
+                    }
+                    fat_entries[i] = existing;
+                    continue;
+                }
+                if (existing != nullptr) {
+                    throw std::invalid_argument("File already exists in the image: " + node.host_path);
+                }
+
+                DirectoryEntry* slot = find_empty_dir(parent);
+                if (slot == nullptr) {
+                    throw std::runtime_error("No free directory entry for " + node.host_path);
+                }
+                if (node.directory) {
+                    create_dir(slot, parent, node.name);
+                    dirs.push_back(i);
+                }
+                else {
+                    create_file(slot, parent, node.name);
+                    slot->attributes += linux_mode_attributes(node.mode);
+                    files.push_back(i);
+                }
+                fat_entries[i] = slot;
+            }
+        } catch (...) {
+            rollback();
+            throw;
+        }
+
+        // - Plan every chain in one pass over the free map
+        std::vector<uint32_t> counts(files.size());
+        uint32_t total = 0;
+        for (size_t k = 0; k < files.size(); ++k) {
+            uint32_t cnt = (nodes[files[k]].size + block_size_byte - 1) / block_size_byte;
+            counts[k] = cnt == 0 ? 1 : cnt; // every file owns at least one cluster
+            total += counts[k];
+        }
+        if (total > allocator.free_count()) {
+            rollback();
+            throw std::runtime_error("Not enough free clusters on " + name + " to import " + host_dir);
+        }
+
+        std::vector<std::vector<std::pair<char*, size_t>>> runs(files.size());
+        int region = total > 0 ? allocator.allocate_contiguous(total) : -1;
+        uint16_t next = region;
+        try {
+            for (size_t k = 0; k < files.size(); ++k) {
+                DirectoryEntry* entry = fat_entries[files[k]];
+                if (region >= 0) {
+                    // carve consecutive chains out of the reserved region
+                    for (uint32_t c = 0; c + 1 < counts[k]; ++c)
+                        set_fat(next + c, next + c + 1);
+                    set_fat(next + counts[k] - 1, EOC_MARKER);
+                    entry->starting_cluster = next;
+                    next += counts[k];
+                }
+                else {
+                    entry->starting_cluster = reserve_chain(counts[k]);
+                }
+                for (auto& run : get_chain_runs(entry->starting_cluster))
+                    runs[k].push_back(std::make_pair(reinterpret_cast<char*>(cluster_ptr(run.start)),
+                                                     static_cast<size_t>(run.count) * block_size_byte));
+            }
+        } catch (...) {
+            rollback();
+            throw;
+        }
+        if (region >= 0)
+            stats.add(STAT_CLUSTERS_ALLOCATED, total);
+
+        // - Read contents in parallel, each worker writes disjoint clusters
+        std::vector<uint32_t> copied(files.size());
+        try {
+            parallel_for(files.size(), IMPORT_GRAIN, [&](size_t begin, size_t end) {
+                for (size_t k = begin; k < end; ++k)
+                    copied[k] = copy_in(nodes[files[k]].host_path, nodes[files[k]].size, runs[k]);
+            });
+        } catch (...) {
+            rollback();
+            throw;
+        }
+
+        // - Finalize entries
+        uint64_t bytes = 0;
+        for (size_t k = 0; k < files.size(); ++k) {
+            DirectoryEntry* entry = fat_entries[files[k]];
+            entry->file_size = copied[k];
+            set_time_date(&entry->last_modification, nodes[files[k]].mtime);
+            mark_dirty(entry, sizeof(DirectoryEntry));
+            for (auto& run : runs[k])
+                mark_dirty(run.first, run.second);
+            bytes += copied[k];
+        }
+        stats.add(STAT_BYTES_IN, bytes);
+
+        output() << "Imported " << files.size() << " files and " << dirs.size() << " directories ("
+                 << bytes << " bytes) into " << fat_path << '\n';
+    }
+
+}//namespace
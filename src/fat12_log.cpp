@@ -0,0 +1,37 @@
+#include "fat12_log.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+namespace fat12 {
+
+    static int initial_log_level() {
+        const char* env = std::getenv("FAT12_LOG_LEVEL");
+        if (env == nullptr || *env == '\0')
+            return LOG_WARN;
+
+        const char* names[] = { "error", "warn", "info", "debug", "trace" };
+        for (int i = LOG_ERROR; i <= LOG_TRACE; ++i) {
+            if (std::strcmp(env, names[i]) == 0)
+                return i;
+        }
+        if (env[0] >= '0' && env[0] <= '4' && env[1] == '\0')
+            return env[0] - '0';
+        return LOG_WARN;
+    }
+
+    int current_log_level = initial_log_level();
+
+    void set_log_level(int level) {
+        if (level < LOG_ERROR)
+            level = LOG_ERROR;
+        if (level > LOG_TRACE)
+            level = LOG_TRACE;
+        current_log_level = level;
+    }
+
+    std::ostream& log_stream() {
+        return std::cerr;
+    }
+
+}//namespace
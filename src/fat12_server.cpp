@@ -0,0 +1,307 @@
+#include "fat12_server.hpp"
+#include "fat12_utils.hpp"
+#include "fat12_log.hpp"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace fat12 {
+
+    static volatile sig_atomic_t stop_requested = 0;
+
+    static void request_stop(int) {
+        stop_requested = 1;
+    }
+
+    static string ok_response(const string& output) {
+        return "{\"status\":\"ok\",\"output\":\"" + json_escape(output) + "\"}\n";
+    }
+
+    static string error_response(const string& error) {
+        return "{\"status\":\"error\",\"error\":\"" + json_escape(error) + "\"}\n";
+    }
+
+    fat12_server::fat12_server(const string& socket_path, FlushPolicy policy, int flush_interval)
+        : socket_path(socket_path), flush_policy(policy), flush_interval(flush_interval),
+          listen_fd(-1), running(false), last_flush(std::time(nullptr)) {
+
+        if (socket_path.size() >= sizeof(sockaddr_un::sun_path)) {
+            throw std::invalid_argument("Socket path too long: " + socket_path);
+        }
+
+        if (pipe2(wake_fds, O_CLOEXEC | O_NONBLOCK) < 0) {
+            throw std::runtime_error(string("Error creating pipe: ") + std::strerror(errno));
+        }
+
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0) {
+            throw std::runtime_error(string("Error creating socket: ") + std::strerror(errno));
+        }
+
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(socket_path.c_str()); // stale socket of a previous run
+
+        if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0
+            || listen(listen_fd, SOMAXCONN) < 0) {
+            int err = errno;
+            ::close(listen_fd);
+            ::close(wake_fds[0]);
+            ::close(wake_fds[1]);
+            throw std::runtime_error("Error listening on " + socket_path + ": " + std::strerror(err));
+        }
+    }
+
+    fat12_server::~fat12_server() {
+        reap_clients(true);
+        if (listen_fd >= 0) {
+            ::close(listen_fd);
+            unlink(socket_path.c_str());
+        }
+        ::close(wake_fds[0]);
+        ::close(wake_fds[1]);
+
+        for (auto& image : images) {
+            try {
+                image.second->dump_fs();
+            } catch (const std::exception& e) {
+                FAT12_ERROR("Error flushing " << image.first << ": " << e.what());
+            }
+            delete image.second;
+        }
+    }
+
+    // Absolute path of an image with symlinks resolved, or "" when it doesn't exist
+    static string resolve_path(const string& image) {
+        char* resolved = realpath(image.c_str(), nullptr);
+        if (resolved == nullptr)
+            return "";
+        string path(resolved);
+        std::free(resolved);
+        return path;
+    }
+
+    // Images are keyed by their resolved path, so different spellings of
+    // one file share a single fat12_fs instead of allocating independently
+    fat12_fs* fat12_server::mount(const string& image) {
+        string path = resolve_path(image);
+        if (path.empty()) {
+            throw std::invalid_argument("Error opening image " + image + ": " + std::strerror(errno));
+        }
+
+        std::lock_guard<std::mutex> guard(images_lock);
+        auto it = images.find(path);
+        if (it != images.end())
+            return it->second;
+
+        fat12_fs* fs = new fat12_fs(path, true);
+        try {
+            fs->read_fs();
+        } catch (...) {
+            delete fs;
+            throw;
+        }
+        images[path] = fs;
+        return fs;
+    }
+
+    // An image mounted at startup; clients can't make the server open other files
+    fat12_fs* fat12_server::find_image(const string& image) {
+        string path = resolve_path(image);
+        std::lock_guard<std::mutex> guard(images_lock);
+        auto it = path.empty() ? images.end() : images.find(path);
+        if (it == images.end()) {
+            throw std::invalid_argument("Image is not served: " + image);
+        }
+        return it->second;
+    }
+
+    void fat12_server::flush_all() {
+        std::lock_guard<std::mutex> guard(images_lock);
+        for (auto& image : images)
+            image.second->dump_fs();
+        last_flush = std::time(nullptr);
+    }
+
+    void fat12_server::stop() {
+        running = false;
+        wake();
+    }
+
+    void fat12_server::wake() {
+        char byte = 0;
+        if (write(wake_fds[1], &byte, 1) < 0 && errno != EAGAIN) {
+            FAT12_WARN("Cannot wake the server loop: " << std::strerror(errno));
+        }
+    }
+
+    void fat12_server::run() {
+        std::signal(SIGPIPE, SIG_IGN);
+        std::signal(SIGINT, request_stop);
+        std::signal(SIGTERM, request_stop);
+
+        running = true;
+        FAT12_INFO("Serving on " << socket_path);
+
+        while (running && !stop_requested) {
+            pollfd fds[2] = { {listen_fd, POLLIN, 0}, {wake_fds[0], POLLIN, 0} };
+
+            int timeout = -1;
+            if (flush_policy == FLUSH_PERIODIC) {
+                long due = last_flush + flush_interval - std::time(nullptr);
+                timeout = due > 0 ? static_cast<int>(due * 1000) : 0;
+            }
+
+            int ready = poll(fds, 2, timeout);
+            if (ready < 0 && errno != EINTR) {
+                throw std::runtime_error(string("poll failed: ") + std::strerror(errno));
+            }
+
+            if (ready > 0 && (fds[1].revents & POLLIN)) {
+                char drain[64];
+                while (read(wake_fds[0], drain, sizeof(drain)) > 0)
+                    ;
+                reap_clients(false);
+            }
+
+            if (flush_policy == FLUSH_PERIODIC && std::time(nullptr) >= last_flush + flush_interval)
+                flush_all();
+            if (ready <= 0)
+                continue;
+
+            if (fds[0].revents & POLLIN)
+                accept_client();
+        }
+
+        reap_clients(true);
+        FAT12_INFO("Shutting down, flushing " << images.size() << " images");
+        flush_all();
+    }
+
+    void fat12_server::accept_client() {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            FAT12_WARN("accept failed: " << std::strerror(errno));
+            return;
+        }
+
+        // stop signals must reach the thread blocked in poll()
+        sigset_t blocked, previous;
+        sigemptyset(&blocked);
+        sigaddset(&blocked, SIGINT);
+        sigaddset(&blocked, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+
+        clients.emplace_back(fd);
+        Client& client = clients.back();
+        try {
+            client.worker = std::thread(&fat12_server::client_loop, this, std::ref(client));
+        } catch (const std::exception& e) {
+            FAT12_WARN("Cannot start a client thread: " << e.what());
+            ::close(fd);
+            clients.pop_back();
+        }
+        pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    }
+
+    // Join client threads that are done, or all of them, first cutting
+    // off their input so blocked reads return. Replies still go out.
+    void fat12_server::reap_clients(bool all) {
+        for (auto it = clients.begin(); it != clients.end(); ) {
+            if (all && !it->done)
+                shutdown(it->fd, SHUT_RD);
+            if (!all && !it->done) {
+                ++it;
+                continue;
+            }
+            if (it->worker.joinable())
+                it->worker.join();
+            ::close(it->fd);
+            it = clients.erase(it);
+        }
+    }
+
+    void fat12_server::client_loop(Client& client) {
+        while (running && serve_client(client))
+            ;
+        client.done = true;
+        wake();
+    }
+
+    // Read what the client sent and answer every complete line.
+    // Returns false once the client is gone.
+    bool fat12_server::serve_client(Client& client) {
+        char buf[4096];
+        ssize_t n = recv(client.fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR)
+            return true;
+        if (n <= 0)
+            return false;
+        client.pending.append(buf, n);
+
+        size_t eol;
+        while ((eol = client.pending.find('\n')) != string::npos) {
+            string line = client.pending.substr(0, eol);
+            client.pending.erase(0, eol + 1);
+
+            string response = handle_request(line);
+            size_t sent = 0;
+            while (sent < response.size()) {
+                ssize_t w = send(client.fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w <= 0)
+                    return false;
+                sent += w;
+            }
+        }
+        return true;
+    }
+
+    string fat12_server::handle_request(const string& line) {
+        std::istringstream iss(line);
+        string image, operation, param;
+        iss >> image >> operation;
+        std::getline(iss >> std::ws, param);
+        if (!param.empty() && param[param.size() - 1] == '\r')
+            param.erase(param.size() - 1);
+
+        if (image == "shutdown" && operation.empty()) {
+            stop();
+            return ok_response("");
+        }
+        if (image.empty() || operation.empty()) {
+            return error_response("Malformed request, expected: <image> <operation> [parameters]");
+        }
+
+        std::ostringstream output;
+        try {
+            fat12_fs* fs = find_image(image);
+            if (operation == "flush") {
+                fs->dump_fs();
+                return ok_response("");
+            }
+
+            fs->dispatch(operation, param, output);
+
+            if (flush_policy == FLUSH_PER_REQUEST && !fat12_fs::is_read_only(operation, param))
+                fs->dump_fs();
+        } catch (const std::exception& e) {
+            return error_response(e.what());
+        }
+        return ok_response(output.str());
+    }
+
+}//namespace
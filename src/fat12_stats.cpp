@@ -0,0 +1,104 @@
+#include "fat12_stats.hpp"
+#include "fat12_utils.hpp"
+#include <iomanip>
+
+namespace fat12 {
+
+    static const char* COUNTER_NAMES[STAT_COUNTER_CNT] = {
+        "dir_entries_scanned",
+        "fat_lookups",
+        "clusters_allocated",
+        "clusters_freed",
+        "bytes_in",
+        "bytes_out",
+        "flushes",
+        "flush_bytes"
+    };
+
+    void LatencyHistogram::add(uint64_t ns) {
+        uint64_t us = ns / 1000;
+        int bucket = 0;
+        while (bucket < BUCKET_CNT - 1 && (1ULL << bucket) <= us)
+            ++bucket;
+        buckets[bucket]++;
+        count++;
+        total_ns += ns;
+        if (ns > max_ns)
+            max_ns = ns;
+    }
+
+    double LatencyHistogram::percentile_us(double p) const {
+        if (count == 0)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(p * count + 0.5);
+        if (rank == 0)
+            rank = 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKET_CNT; ++i) {
+            seen += buckets[i];
+            if (seen >= rank) {
+                double bound = static_cast<double>(1ULL << i);
+                return bound < max_us() ? bound : max_us();
+            }
+        }
+        return max_us();
+    }
+
+    void Stats::reset() {
+        for (auto& counter : counters)
+            counter.store(0, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> guard(commands_lock);
+        commands.clear();
+    }
+
+    void Stats::print(std::ostream& os) const {
+        os << "Stats: " << (is_enabled() ? "enabled" : "disabled") << '\n';
+        for (int i = 0; i < STAT_COUNTER_CNT; ++i)
+            os << "  " << std::left << std::setw(22) << COUNTER_NAMES[i] << std::right << get(StatCounter(i)) << '\n';
+
+        std::lock_guard<std::mutex> guard(commands_lock);
+        if (commands.empty())
+            return;
+        os << "Latency (us):" << std::setw(13) << "count" << std::setw(10) << "mean" << std::setw(10) << "p50"
+           << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "max" << '\n';
+        std::ios::fmtflags flags = os.flags();
+        std::streamsize precision = os.precision();
+        os << std::fixed << std::setprecision(1);
+        for (auto& cmd : commands) {
+            const LatencyHistogram& h = cmd.second;
+            os << "  " << std::left << std::setw(14) << cmd.first << std::right << std::setw(10) << h.samples()
+               << std::setw(10) << h.mean_us() << std::setw(10) << h.percentile_us(0.5)
+               << std::setw(10) << h.percentile_us(0.9) << std::setw(10) << h.percentile_us(0.99)
+               << std::setw(10) << h.max_us() << '\n';
+        }
+        os.flags(flags);
+        os.precision(precision);
+    }
+
+    void Stats::print_json(std::ostream& os) const {
+        os << "{\"enabled\":" << (is_enabled() ? "true" : "false") << ",\"counters\":{";
+        for (int i = 0; i < STAT_COUNTER_CNT; ++i)
+            os << (i ? "," : "") << '"' << COUNTER_NAMES[i] << "\":" << get(StatCounter(i));
+        os << "},\"commands\":{";
+        std::lock_guard<std::mutex> guard(commands_lock);
+        std::ios::fmtflags flags = os.flags();
+        std::streamsize precision = os.precision();
+        os << std::fixed << std::setprecision(1);
+        bool first = true;
+        for (auto& cmd : commands) {
+            const LatencyHistogram& h = cmd.second;
+            os << (first ? "" : ",") << '"' << json_escape(cmd.first) << "\":{"
+               << "\"count\":" << h.samples()
+               << ",\"mean_us\":" << h.mean_us()
+               << ",\"p50_us\":" << h.percentile_us(0.5)
+               << ",\"p90_us\":" << h.percentile_us(0.9)
+               << ",\"p99_us\":" << h.percentile_us(0.99)
+               << ",\"max_us\":" << h.max_us() << "}";
+            first = false;
+        }
+        os << "}}\n";
+        os.flags(flags);
+        os.precision(precision);
+    }
+
+}//namespace
@@ -1,9 +1,14 @@
 
 #include "fat12_utils.hpp"
+#include "fat12_log.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
 #include <stdexcept>
 #include <iostream>
 #include <fstream>
+#include <unistd.h>
 
 namespace fat12 {
     
@@ -17,7 +22,9 @@ namespace fat12 {
     }
 
     bool is_entry_free(const DirectoryEntry& entry) {
-        return entry.filename[0] == DIR_NAME_FREE[0] || entry.filename[0] == DIR_NAME_FREE[1];
+        // filename is plain char, compare as unsigned so 0xE5 matches
+        unsigned char first = static_cast<unsigned char>(entry.filename[0]);
+        return first == DIR_NAME_FREE[0] || first == DIR_NAME_FREE[1];
     }
 
     bool is_file(const DirectoryEntry& entry) {
@@ -32,6 +39,34 @@ namespace fat12 {
         return entry.attributes & ATTR_READABLE;
     }
 
+    bool entry_name_equals(const DirectoryEntry& entry, const string& name) {
+        if (name.size() > ENTRY_NAME_LEN)
+            return false;
+        const char* raw = entry.filename; // filename and extension are contiguous
+        return std::memcmp(raw, name.data(), name.size()) == 0
+            && (name.size() == ENTRY_NAME_LEN || raw[name.size()] == '\0');
+    }
+
+    void check_entry_name(const string& name) {
+        if (name.empty() || name.size() > ENTRY_NAME_LEN) {
+            throw std::invalid_argument("Names must be 1 to 11 characters long: " + name);
+        }
+    }
+
+    void set_entry_name(DirectoryEntry* entry, const string& name) {
+        check_entry_name(name);
+        std::memset(entry->filename, 0, ENTRY_NAME_LEN);
+        std::memcpy(entry->filename, name.data(), name.size());
+    }
+
+    string entry_name(const DirectoryEntry& entry) {
+        const char* raw = entry.filename;
+        size_t len = 0;
+        while (len < ENTRY_NAME_LEN && raw[len] != '\0')
+            ++len;
+        return string(raw, len);
+    }
+
     bool is_reserved_cluster(uint16_t cluster) {
         return (cluster >= FAT_ENTRY_RESERVED_CLUSTER_START && cluster <= FAT_ENTRY_RESERVED_CLUSTER_END);
     }
@@ -48,8 +83,12 @@ namespace fat12 {
     }
     void set_time_date(Timestamp* ts) {
         // Get current time
-        std::time_t t = std::time(nullptr);
-        std::tm* now = std::localtime(&t);
+        set_time_date(ts, std::time(nullptr));
+    }
+
+    void set_time_date(Timestamp* ts, std::time_t t) {
+        std::tm local;
+        std::tm* now = localtime_r(&t, &local);
 
         // Set time field
         ts->time = ((now->tm_hour & 0x1F) << 11) |
@@ -79,6 +118,14 @@ namespace fat12 {
         decoded_time->tm_wday = 0; // Not required for basic time/date extraction
     }
 
+    std::time_t get_time(const Timestamp* ts) {
+        std::tm decoded;
+        get_time_date(ts, &decoded);
+        if (decoded.tm_mday == 0) // never set, e.g. the root's ".." entry
+            return 0;
+        return std::mktime(&decoded);
+    }
+
      std::vector<string> tokenize(const string& path) {
         size_t start = 0, end;
 
@@ -90,13 +137,11 @@ namespace fat12 {
             throw std::invalid_argument("Relative paths are not supported!");
         }
 
-        std::cout << "tokens: ";
         while ((end = path.find('/', start)) != string::npos) {
             auto str = path.substr(start, end - start);
             if (str != "")
             {
                 tokens.push_back(str);
-                std::cout << str << ", ";
             }
             start = end + 1;
         }
@@ -104,14 +149,35 @@ namespace fat12 {
         {
             tokens.push_back(path.substr(start)); // Add the last token
         }
-        
-        std::cout << path.substr(start) << std::endl;
-        // end tokenize
-        std::cout << "end tokenize" << std::endl;
-        std::cout << "token size: " << tokens.size() << std::endl;
+
+        FAT12_TRACE("tokenize " << path << ": " << tokens.size() << " tokens");
         return tokens;
      }
 
+    string json_escape(const string& str) {
+        string escaped;
+        escaped.reserve(str.size());
+        for (unsigned char c : str) {
+            switch (c) {
+                case '"': escaped += "\\\""; break;
+                case '\\': escaped += "\\\\"; break;
+                case '\n': escaped += "\\n"; break;
+                case '\r': escaped += "\\r"; break;
+                case '\t': escaped += "\\t"; break;
+                default:
+                    if (c < 0x20) {
+                        char buf[8];
+                        std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                        escaped += buf;
+                    }
+                    else {
+                        escaped += c;
+                    }
+            }
+        }
+        return escaped;
+    }
+
     string read_linux_file(const string& file_path) {
         std::ifstream src_file(file_path);
         if (!src_file.is_open()) {
@@ -126,6 +192,30 @@ namespace fat12 {
     }
 
 
+    // Owner read/write bits of a Linux mode as FAT attributes
+    uint8_t linux_mode_attributes(mode_t mode) {
+        uint8_t attributes = 0;
+        if (mode & S_IRUSR) {
+            attributes += ATTR_READABLE;
+        }
+        if (mode & S_IWUSR) {
+            attributes += ATTR_WRITABLE;
+        }
+        return attributes;
+    }
+
+    // Owner bits carry the attributes, others get read access as with read()
+    mode_t attributes_linux_mode(uint8_t attributes) {
+        mode_t mode = 0;
+        if (attributes & ATTR_READABLE) {
+            mode |= S_IRUSR | S_IRGRP | S_IROTH;
+        }
+        if (attributes & ATTR_WRITABLE) {
+            mode |= S_IWUSR;
+        }
+        return mode;
+    }
+
     uint8_t read_linux_permissions(const string& file_path) {
         uint8_t attributes = 0;
         struct stat fileStat;
@@ -133,15 +223,31 @@ namespace fat12 {
             
         }
         else {
-            if (fileStat.st_mode & S_IRUSR) {
-                attributes += ATTR_READABLE;
-            }
-            if (fileStat.st_mode & S_IWUSR) {
-                attributes += ATTR_WRITABLE;
-            }
+            attributes = linux_mode_attributes(fileStat.st_mode);
         }
 
         return attributes; 
     }
 
+    // Read into a run of clusters, returns the bytes read. Stops early at
+    // end of file, the source may have shrunk since its size was taken.
+    size_t read_linux_run(int fd, char* dst, size_t want, size_t run_bytes, const string& file_path) {
+        size_t done = 0;
+        while (done < want) {
+            ssize_t got = ::read(fd, dst + done, want - done);
+            if (got < 0) {
+                if (errno == EINTR)
+                    continue;
+                string source = file_path.empty() ? "" : file_path + ": ";
+                throw std::runtime_error("Error reading input file: " + source + std::strerror(errno));
+            }
+            if (got == 0)
+                break;
+            done += got;
+        }
+        // don't leak stale data in the slack of the last cluster
+        std::memset(dst + done, 0, run_bytes - done);
+        return done;
+    }
+
 }//namespace
@@ -7,29 +7,37 @@
 #include <sstream>
 
 #include "fat12.hpp"
+#include "fat12_server.hpp"
 using fat12::fat12_fs;
+using fat12::fat12_server;
 
 // prototypes
 void test();
 void makefilesystem(int argc, char* argv[]);
-void filesystemoper(int argc, char* argv[]);
+int filesystemoper(int argc, char* argv[]);
+void filesystemserver(int argc, char* argv[]);
 
 
 // fileSystemOper fileSystem.data operation parameters
 int main(int argc, char* argv[]) {
     bool operate = false;
+    int status = 0;
 
     #ifdef MAKEFILESYSTEM
         makefilesystem(argc, argv);
     #else
         #ifdef FILESYSTEMOPER
-            filesystemoper(argc, argv);
+            status = filesystemoper(argc, argv);
         #else
-            //test();
+            #ifdef FILESYSTEMSERVER
+                filesystemserver(argc, argv);
+            #else
+                //test();
+            #endif
         #endif
     #endif
 
-    return 0;
+    return status;
 }
 
 void test() {
@@ -64,42 +72,125 @@ void test() {
 
 void makefilesystem(int argc, char* argv[]) {
     // Check if the number of arguments is correct
-    if (argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " <integer> <string>" << std::endl;
+    if (argc != 3 && argc != 4) {
+        std::cerr << "Usage: " << argv[0] << " <block size KB: 0.5|1|2|4|8|16|32> <string> [volume size MB]" << std::endl;
         return;
     }
 
-    // Check if the first argument is an integer
+    // Check if the first argument is a number
     char* end;
-    long size = std::strtol(argv[1], &end, 10);
+    double size = std::strtod(argv[1], &end);
     if (*end != '\0') {
-        std::cerr << "The first argument must be an integer." << std::endl;
+        std::cerr << "The first argument must be a number." << std::endl;
         return;
     }
 
     // Get the second argument as a string
     std::string fs_name = argv[2];
 
+    // Volume size defaults to 4096 blocks, larger volumes switch to FAT16
+    uint32_t block_cnt = fat12::DEFAULT_BLOCK_CNT;
+    if (argc == 4) {
+        double volume_mb = std::strtod(argv[3], &end);
+        if (*end != '\0' || volume_mb <= 0 || size <= 0) {
+            std::cerr << "The volume size must be a positive number." << std::endl;
+            return;
+        }
+        block_cnt = static_cast<uint32_t>(volume_mb * 1024 / size);
+    }
+
     fat12_fs fs(fs_name);
     // use args
-    fs.create_fs(size);
+    fs.create_fs(size, block_cnt);
 }
 
 
-void filesystemoper(int argc, char* argv[]) {
+// fileSystemOper fileSystem.data batch script.txt
+// runs every line of the script (or stdin for "-") against a single mount.
+// Exits with 1 when the operation, or any operation of the batch, failed.
+int filesystemoper(int argc, char* argv[]) {
     bool operate = false;
+    bool ok = true;
     if (argc < 3) {
         std::cout << "Usage: " << argv[0] << " fileSystem.data operation [parameters]" << std::endl;
+        std::cout << "       " << argv[0] << " fileSystem.data batch <script|->" << std::endl;
+        return 1;
     }
     else operate = true;
 
     std::string file_system_path = argv[1];
-    fat12_fs fs(file_system_path);
+    fat12_fs fs(file_system_path, true); // mmap backed, only touched pages are written back
 
     fs.read_fs();
     if (operate) {
         std::string operation = argv[2];
-        fs.operate(operation, argv[3]);
+        std::string param = argc > 3 ? argv[3] : "";
+        if (operation == "batch") {
+            if (param.empty() || param == "-") {
+                ok = fs.run_batch(std::cin) == 0;
+            }
+            else {
+                std::ifstream script(param);
+                if (!script.is_open()) {
+                    std::cerr << "Error opening script file: " << param << std::endl;
+                    return 1;
+                }
+                ok = fs.run_batch(script) == 0;
+            }
+        }
+        else {
+            // A single command looks each directory on its path up about
+            // once, scanning the slots is cheaper than building an index
+            fs.set_dir_index(false);
+            ok = fs.operate(operation, param);
+        }
     }
     fs.dump_fs();
-}
\ No newline at end of file
+    return ok ? 0 : 1;
+}
+
+// fileSystemServer socket_path [--flush=request|shutdown|<seconds>] [fileSystem.data ...]
+void filesystemserver(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " socket_path [--flush=request|shutdown|<seconds>] [fileSystem.data ...]" << std::endl;
+        return;
+    }
+
+    fat12::FlushPolicy policy = fat12::FLUSH_PER_REQUEST;
+    int interval = 5;
+    std::vector<std::string> images;
+
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 8, "--flush=") == 0) {
+            std::string mode = arg.substr(8);
+            if (mode == "request") {
+                policy = fat12::FLUSH_PER_REQUEST;
+            }
+            else if (mode == "shutdown") {
+                policy = fat12::FLUSH_ON_SHUTDOWN;
+            }
+            else {
+                char* end;
+                interval = std::strtol(mode.c_str(), &end, 10);
+                if (*end != '\0' || interval <= 0) {
+                    std::cerr << "Invalid flush mode: " << mode << std::endl;
+                    return;
+                }
+                policy = fat12::FLUSH_PERIODIC;
+            }
+        }
+        else {
+            images.push_back(arg);
+        }
+    }
+
+    try {
+        fat12_server server(argv[1], policy, interval);
+        for (auto& image : images)
+            server.add_image(image);
+        server.run();
+    } catch (const std::exception& e) {
+        std::cerr << "Server error: " << e.what() << std::endl;
+    }
+}
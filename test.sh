@@ -24,4 +24,79 @@ make all
 ./fileSystemOper 1kb-fs chmod "/usr/ysa/file1 +rw"
 ./fileSystemOper 1kb-fs read "/usr/ysa/file1 read_file.txt" #succeeds
 ./fileSystemOper 1kb-fs dumpe2fs
-#./fileSystemOper 1kb-fs
\ No newline at end of file
+#./fileSystemOper 1kb-fs
+
+# Error paths of the commands that change or copy out data. The image is
+# corrupted by hand: set_fat patches a 12-bit FAT entry in both copies,
+# set_entry a 16/32-bit field of a root directory slot (26 = starting
+# cluster, 28 = file size).
+fat_start() { ./fileSystemOper "$1" dumpe2fs | awk "/$2 Start/ {print \$NF}"; }
+set_bytes() { printf "$(printf '\\%03o' "${@:3}")" | dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null; }
+set_fat() {
+    for fat in FAT1 FAT2; do
+        off=$(( $(fat_start "$1" $fat) + $2 * 3 / 2 ))
+        read b0 b1 <<< "$(od -An -tu1 -j$off -N2 "$1")"
+        if (( $2 % 2 == 0 )); then
+            set_bytes "$1" $off $(( $3 & 0xFF )) $(( (b1 & 0xF0) | ($3 >> 8) ))
+        else
+            set_bytes "$1" $off $(( (b0 & 0x0F) | (($3 & 0xF) << 4) )) $(( $3 >> 4 ))
+        fi
+    done
+}
+set_entry() {
+    off=$(( $(fat_start "$1" "Root Directory") + $2 * 32 + $3 ))
+    if (( $3 == 26 )); then
+        set_bytes "$1" $off $(( $4 & 0xFF )) $(( $4 >> 8 ))
+    else
+        set_bytes "$1" $off $(( $4 & 0xFF )) $(( ($4 >> 8) & 0xFF )) $(( ($4 >> 16) & 0xFF )) $(( $4 >> 24 ))
+    fi
+}
+seq 1 1000 > seq_file.txt # 3893 bytes, 4 clusters
+
+# export fails on a file whose chain is shorter than its size
+rm -rf err-fs export_out
+./makeFileSystem 1 err-fs
+./fileSystemOper err-fs write "/a seq_file.txt"
+./fileSystemOper err-fs write "/b seq_file.txt"
+./fileSystemOper err-fs export "/ export_out" && cmp seq_file.txt export_out/b && echo "export OK"
+set_entry err-fs 0 28 100000
+./fileSystemOper err-fs export "/ export_out" && echo "FAIL: export of /a succeeded"
+
+# defrag refuses a cross-linked volume and leaves it untouched
+rm -rf err-fs
+./makeFileSystem 1 err-fs
+./fileSystemOper err-fs write "/A seq_file.txt" # clusters 2-5
+./fileSystemOper err-fs write "/B seq_file.txt" # clusters 6-9
+./fileSystemOper err-fs write "/C seq_file.txt" # clusters 10-13
+./fileSystemOper err-fs del "/B"
+set_fat err-fs 3 10 # /A runs into /C
+cp err-fs err-fs.orig
+./fileSystemOper err-fs defrag && echo "FAIL: defrag of a cross-linked volume succeeded"
+cmp -s err-fs err-fs.orig || echo "FAIL: defrag changed a cross-linked volume"
+rm -f err-fs.orig
+
+# fsck -r cuts cross-links, also one at a file's first cluster
+rm -rf err-fs
+./makeFileSystem 1 err-fs
+./fileSystemOper err-fs write "/A seq_file.txt" # clusters 2-5
+./fileSystemOper err-fs write "/B seq_file.txt" # clusters 6-9
+./fileSystemOper err-fs write "/C seq_file.txt" # clusters 10-13
+set_fat err-fs 7 3 # /B runs into /A
+set_entry err-fs 2 26 2 # /C starts on /A's first cluster
+./fileSystemOper err-fs fsck | grep -q " 3 problems" || echo "FAIL: fsck missed a cross-link or the lost clusters"
+./fileSystemOper err-fs fsck -r | grep -q "3 repaired" || echo "FAIL: fsck -r left something unrepaired"
+./fileSystemOper err-fs fsck | grep -q " 0 problems" || echo "FAIL: fsck -r left problems"
+./fileSystemOper err-fs read "/A read_file.txt" && cmp -s seq_file.txt read_file.txt || echo "FAIL: fsck -r changed /A"
+./fileSystemOper err-fs del "/C"
+./fileSystemOper err-fs read "/A read_file.txt" && cmp -s seq_file.txt read_file.txt || echo "FAIL: del of a repaired file freed /A"
+
+# a failed import leaves neither the directories it created nor clusters behind
+rm -rf err-fs import_in
+./makeFileSystem 1 err-fs
+mkdir -p import_in/d1
+cp seq_file.txt import_in/d1/a
+cp seq_file.txt import_in/zz
+./fileSystemOper err-fs write "/zz seq_file.txt"
+./fileSystemOper err-fs import "import_in /" && echo "FAIL: import over an existing name succeeded"
+./fileSystemOper err-fs dir "/d1" > /dev/null && echo "FAIL: failed import left /d1 behind"
+./fileSystemOper err-fs fsck | grep -q " 0 problems" || echo "FAIL: failed import left problems"